@@ -0,0 +1,256 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <type_traits>
+#include <vector>
+#include "utils.h"
+
+namespace iRangeGraph
+{
+    // Types of the attribute column an index can hold. The values are kept as int64 keys in the order of the
+    // values: integers (timestamps included) as they are, floating-point values through OrderedKey.
+    enum AttributeType : uint32_t
+    {
+        kAttributeNone = 0,
+        kAttributeInt64 = 1,
+        kAttributeFloat64 = 2,
+    };
+
+    // Maps a double to an int64 such that keys compare like the values; consecutive keys are consecutive doubles.
+    inline int64_t OrderedKey(double value)
+    {
+        if (std::isnan(value))
+            throw Exception("attribute values cannot be NaN");
+        if (value == 0)
+            value = 0.0;
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        bits = (bits >> 63) ? ~bits : bits | (1ull << 63);
+        return (int64_t)(bits ^ (1ull << 63));
+    }
+
+    // One end of a range of attribute values: inclusive, exclusive, or absent for a range open on that side.
+    struct AttributeBound
+    {
+        bool bounded{false};
+        bool inclusive{true};
+        bool floating{false};
+        int64_t int_value{0};
+        double float_value{0};
+
+        static AttributeBound Unbounded() { return AttributeBound(); }
+
+        template <typename T>
+        static AttributeBound Inclusive(T value) { return Make(value, true); }
+
+        template <typename T>
+        static AttributeBound Exclusive(T value) { return Make(value, false); }
+
+    private:
+        template <typename T>
+        static AttributeBound Make(T value, bool inclusive)
+        {
+            static_assert(std::is_arithmetic<T>::value, "attribute bounds are numbers");
+            AttributeBound bound;
+            bound.bounded = true;
+            bound.inclusive = inclusive;
+            bound.floating = std::is_floating_point<T>::value;
+            if (bound.floating)
+                bound.float_value = value;
+            else
+                bound.int_value = value;
+            return bound;
+        }
+    };
+
+    // The attribute values of the indexed points in ascending order, so position i holds the value of point i.
+    // The keys are owned, or live in a mapped search image.
+    class AttributeColumn
+    {
+    public:
+        AttributeType type() const { return type_; }
+        bool empty() const { return type_ == kAttributeNone; }
+        size_t size() const { return size_; }
+        const int64_t *data() const { return keys_; }
+
+        void assign(AttributeType type, std::vector<int64_t> keys)
+        {
+            owned_ = std::move(keys);
+            view(type, owned_.data(), owned_.size());
+        }
+
+        void view(AttributeType type, const int64_t *keys, size_t n)
+        {
+            type_ = type;
+            keys_ = keys;
+            size_ = n;
+        }
+
+        // The positions [ql, qr] of the points whose values lie between lo and hi; ql > qr when there are none.
+        std::pair<int, int> ranks(const AttributeBound &lo, const AttributeBound &hi) const
+        {
+            if (empty())
+                throw Exception("the index holds no attribute column; build it with an attribute file");
+            int64_t key;
+            size_t first = 0, last = size_;
+            if (lo.bounded)
+                first = lowest_key(lo, key) ? first_not_less(key) : size_;
+            if (hi.bounded)
+                last = highest_key(hi, key) ? (key == std::numeric_limits<int64_t>::max() ? size_ : first_not_less(key + 1)) : 0;
+            return {(int)first, (int)last - 1};
+        }
+
+    private:
+        AttributeType type_{kAttributeNone};
+        const int64_t *keys_{nullptr};
+        size_t size_{0};
+        std::vector<int64_t> owned_;
+
+        // Branchless binary search: the loop runs log2(n) times whatever the keys, with a conditional move per
+        // step, and prefetches both halves the next step may look at.
+        size_t first_not_less(int64_t key) const
+        {
+            if (size_ == 0)
+                return 0;
+            const int64_t *base = keys_;
+            size_t len = size_;
+            while (len > 1)
+            {
+                size_t half = len / 2;
+                __builtin_prefetch(base + half / 2);
+                __builtin_prefetch(base + half + half / 2);
+                base = base[half] < key ? base + half : base;
+                len -= half;
+            }
+            return (base - keys_) + (*base < key);
+        }
+
+        // Integer bounds beyond 2^53 round to a double on either side of them: 1 when rounded is above value, -1
+        // when below, 0 when exact. The double next to rounded lies on the other side of value.
+        static int RoundingSide(double rounded, int64_t value)
+        {
+            if (rounded >= 0x1p63)
+                return 1;
+            int64_t back = (int64_t)rounded;
+            return back > value ? 1 : back < value ? -1 : 0;
+        }
+
+        // The smallest key a lower bound admits; false when it admits none.
+        bool lowest_key(const AttributeBound &bound, int64_t &key) const
+        {
+            if (type_ == kAttributeFloat64)
+            {
+                double value = bound.floating ? bound.float_value : (double)bound.int_value;
+                int side = bound.floating ? 0 : RoundingSide(value, bound.int_value);
+                key = OrderedKey(value);
+                if (side > 0 || (side == 0 && bound.inclusive))
+                    return true;
+                if (key == std::numeric_limits<int64_t>::max())
+                    return false;
+                key++;
+                return true;
+            }
+            if (!bound.floating)
+            {
+                key = bound.int_value;
+                if (bound.inclusive)
+                    return true;
+                if (key == std::numeric_limits<int64_t>::max())
+                    return false;
+                key++;
+                return true;
+            }
+            // the step past an exclusive bound is taken on the integer, as doubles beyond 2^53 cannot take it
+            double value = bound.inclusive ? std::ceil(bound.float_value) : std::floor(bound.float_value);
+            if (std::isnan(value))
+                throw Exception("attribute bounds cannot be NaN");
+            if (value >= 0x1p63)
+                return false;
+            key = value < -0x1p63 ? std::numeric_limits<int64_t>::min() : (int64_t)value;
+            if (bound.inclusive || value < -0x1p63)
+                return true;
+            if (key == std::numeric_limits<int64_t>::max())
+                return false;
+            key++;
+            return true;
+        }
+
+        // The largest key an upper bound admits; false when it admits none.
+        bool highest_key(const AttributeBound &bound, int64_t &key) const
+        {
+            if (type_ == kAttributeFloat64)
+            {
+                double value = bound.floating ? bound.float_value : (double)bound.int_value;
+                int side = bound.floating ? 0 : RoundingSide(value, bound.int_value);
+                key = OrderedKey(value);
+                if (side < 0 || (side == 0 && bound.inclusive))
+                    return true;
+                if (key == std::numeric_limits<int64_t>::min())
+                    return false;
+                key--;
+                return true;
+            }
+            if (!bound.floating)
+            {
+                key = bound.int_value;
+                if (bound.inclusive)
+                    return true;
+                if (key == std::numeric_limits<int64_t>::min())
+                    return false;
+                key--;
+                return true;
+            }
+            double value = bound.inclusive ? std::floor(bound.float_value) : std::ceil(bound.float_value);
+            if (std::isnan(value))
+                throw Exception("attribute bounds cannot be NaN");
+            if (value < -0x1p63)
+                return false;
+            key = value >= 0x1p63 ? std::numeric_limits<int64_t>::max() : (int64_t)value;
+            if (bound.inclusive || value >= 0x1p63)
+                return true;
+            if (key == std::numeric_limits<int64_t>::min())
+                return false;
+            key--;
+            return true;
+        }
+    };
+
+    // Reads n attribute values stored back to back as type_name (int32, int64, float32 or float64) into keys and
+    // returns the column type. The values have to be in ascending order, the order of the data points.
+    inline AttributeType LoadAttributeFile(std::string path, std::string type_name, size_t n, std::vector<int64_t> &keys)
+    {
+        std::ifstream infile(path, std::ios::in | std::ios::binary);
+        if (!infile.is_open())
+            throw Exception("cannot open " + path);
+        size_t width = type_name == "int32" || type_name == "float32" ? 4 : type_name == "int64" || type_name == "float64" ? 8 : 0;
+        if (width == 0)
+            throw Exception("attribute type should be int32, int64, float32 or float64");
+        std::vector<char> raw(n * width);
+        infile.read(raw.data(), raw.size());
+        if (infile.gcount() != (std::streamsize)raw.size())
+            throw Exception(path + " holds fewer than " + std::to_string(n) + " attribute values");
+
+        AttributeType type = type_name[0] == 'f' ? kAttributeFloat64 : kAttributeInt64;
+        keys.resize(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            const char *value = raw.data() + i * width;
+            if (type_name == "int32")
+                keys[i] = *(const int32_t *)value;
+            else if (type_name == "int64")
+                keys[i] = *(const int64_t *)value;
+            else if (type_name == "float32")
+                keys[i] = OrderedKey(*(const float *)value);
+            else
+                keys[i] = OrderedKey(*(const double *)value);
+            if (i > 0 && keys[i] < keys[i - 1])
+                throw Exception("attribute value " + std::to_string(i) + " in " + path + " is smaller than the one before; the data should be sorted by the attribute");
+        }
+        return type;
+    }
+}
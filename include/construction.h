@@ -2,14 +2,223 @@
 
 #include <thread>
 #include <map>
+#include <atomic>
+#include <functional>
 #include "utils.h"
+#include "index_io.h"
 #include "searcher.hpp"
+#include "scheduler.hpp"
+#include "memory.hpp"
+#include <memory>
+#include <cmath>
+#include <limits>
 #include <bitset>
 
 namespace iRangeGraph
 {
     typedef std::pair<float, int> PFI;
 
+    // Adjacency lists of the points at one layer, in fixed slots of width entries. A list never holds more points
+    // than its node has, so the slots of the bottom layers are narrower than M. The slots are allocated in
+    // chunks of chunk_span points, each the points of one tree node, when the first list in a chunk is written.
+    // Once its lists are final, a chunk is handed to the index writer and freed, distances included, so the
+    // layers of finished subtrees do not stay in memory.
+    class LayerEdges
+    {
+    public:
+        // sizes, ids and distances of count points from lbound on, in one mapping: chunks are freed in no
+        // particular order, and the allocator would keep the holes they leave
+        struct Chunk
+        {
+            int lbound;
+            size_t count;
+            size_t bytes;
+            int *sizes;
+            int *ids;
+            float *dists;
+
+            Chunk(int l, size_t n, size_t width) : lbound(l), count(n)
+            {
+                size_t sizes_bytes = (count * sizeof(int) + 63) / 64 * 64;
+                size_t ids_bytes = (count * width * sizeof(int) + 63) / 64 * 64;
+                bytes = sizes_bytes + 2 * ids_bytes;
+                char *block = (char *)memory::map_zeroed(bytes);
+                if (block == nullptr)
+                    throw std::runtime_error("Not enough memory");
+                sizes = (int *)block;
+                ids = (int *)(block + sizes_bytes);
+                dists = (float *)(block + sizes_bytes + ids_bytes);
+            }
+
+            Chunk(const Chunk &) = delete;
+            Chunk &operator=(const Chunk &) = delete;
+
+            ~Chunk() { memory::unmap(sizes, bytes); }
+        };
+
+        size_t nb{0};
+        size_t width{0};
+        long long chunk_span{0};
+        // parent nodes in each chunk whose merge still reads it
+        std::vector<std::atomic<int>> pending;
+
+        LayerEdges(size_t n, size_t w, long long span) : nb(n), width(w), chunk_span(span), pending((n + span - 1) / span), chunks((n + span - 1) / span)
+        {
+        }
+
+        LayerEdges(const LayerEdges &) = delete;
+        LayerEdges &operator=(const LayerEdges &) = delete;
+
+        ~LayerEdges()
+        {
+            for (auto &chunk : chunks)
+                delete chunk.load();
+        }
+
+        size_t chunk_num() const { return chunks.size(); }
+
+        size_t chunk_index(int pid) const { return pid / chunk_span; }
+
+        // Takes the chunk out of the layer; null if none of its lists was written.
+        std::shared_ptr<Chunk> release(size_t index)
+        {
+            return std::shared_ptr<Chunk>(chunks[index].exchange(nullptr));
+        }
+
+        int size(int pid) const
+        {
+            const Chunk *chunk = find(pid);
+            return chunk == nullptr ? 0 : chunk->sizes[pid - chunk->lbound];
+        }
+
+        const int *neighbors(int pid) const
+        {
+            const Chunk *chunk = find(pid);
+            return chunk == nullptr ? nullptr : chunk->ids + (size_t)(pid - chunk->lbound) * width;
+        }
+
+        int *neighbors(int pid)
+        {
+            Chunk &chunk = touch(pid);
+            return chunk.ids + (size_t)(pid - chunk.lbound) * width;
+        }
+
+        float *distances(int pid)
+        {
+            Chunk &chunk = touch(pid);
+            return chunk.dists + (size_t)(pid - chunk.lbound) * width;
+        }
+
+        void get(int pid, std::vector<PFI> &list) const
+        {
+            list.clear();
+            const Chunk *chunk = find(pid);
+            if (chunk == nullptr)
+                return;
+            size_t slot = pid - chunk->lbound;
+            const int *id = chunk->ids + slot * width;
+            const float *dist = chunk->dists + slot * width;
+            for (int i = 0; i < chunk->sizes[slot]; i++)
+                list.emplace_back(dist[i], id[i]);
+        }
+
+        void set(int pid, const std::vector<PFI> &list)
+        {
+            if (list.size() > width)
+                throw Exception("linklist size is bigger than M");
+            Chunk &chunk = touch(pid);
+            size_t slot = pid - chunk.lbound;
+            int *id = chunk.ids + slot * width;
+            float *dist = chunk.dists + slot * width;
+            for (size_t i = 0; i < list.size(); i++)
+            {
+                dist[i] = list[i].first;
+                id[i] = list[i].second;
+            }
+            chunk.sizes[slot] = list.size();
+        }
+
+        void set_size(int pid, int size)
+        {
+            Chunk &chunk = touch(pid);
+            chunk.sizes[pid - chunk.lbound] = size;
+        }
+
+        void copy_range(const LayerEdges &from, int l, int r)
+        {
+            for (int pid = l; pid <= r; pid++)
+            {
+                const Chunk *chunk = from.find(pid);
+                if (chunk == nullptr)
+                    continue;
+                size_t slot = pid - chunk->lbound;
+                int size = chunk->sizes[slot];
+                std::memcpy(neighbors(pid), chunk->ids + slot * from.width, size * sizeof(int));
+                std::memcpy(distances(pid), chunk->dists + slot * from.width, size * sizeof(float));
+                set_size(pid, size);
+            }
+        }
+
+    private:
+        std::vector<std::atomic<Chunk *>> chunks;
+        std::mutex chunk_mutex;
+
+        const Chunk *find(int pid) const { return chunks[pid / chunk_span].load(std::memory_order_acquire); }
+
+        Chunk &touch(int pid)
+        {
+            auto &slot = chunks[pid / chunk_span];
+            Chunk *chunk = slot.load(std::memory_order_acquire);
+            if (chunk != nullptr)
+                return *chunk;
+            std::lock_guard<std::mutex> lock(chunk_mutex);
+            chunk = slot.load(std::memory_order_acquire);
+            if (chunk == nullptr)
+            {
+                long long lbound = pid / chunk_span * chunk_span;
+                chunk = new Chunk(lbound, std::min<long long>(chunk_span, nb - lbound), width);
+                slot.store(chunk, std::memory_order_release);
+            }
+            return *chunk;
+        }
+    };
+
+    // Scratch state for one build thread. Visited marks are epoch tags over the range of the node being
+    // built, so starting a new search is a counter bump instead of a clear, and no two threads share marks.
+    struct BuildContext
+    {
+        std::vector<uint32_t> visited;
+        uint32_t epoch{0};
+        int offset{0};
+        std::vector<PFI> pool;
+        std::vector<PFI> candidates;
+        std::vector<int> enterpoints;
+        std::vector<PFI> old_list;
+        std::vector<PFI> new_list;
+        std::vector<PFI> pruned;
+        std::vector<bool> pruned_from_old;
+
+        void begin(int lbound, size_t range_size)
+        {
+            offset = lbound;
+            if (visited.size() < range_size)
+            {
+                visited.assign(range_size, 0);
+                epoch = 0;
+            }
+            if (++epoch == 0)
+            {
+                std::fill(visited.begin(), visited.end(), 0);
+                epoch = 1;
+            }
+            pool.clear();
+            candidates.clear();
+        }
+
+        bool is_visited(int pid) const { return visited[pid - offset] == epoch; }
+        void set_visited(int pid) { visited[pid - offset] = epoch; }
+    };
+
     template <typename dist_t>
     class iRangeGraph_Build
     {
@@ -17,7 +226,19 @@ namespace iRangeGraph
         size_t max_threads = 32;
         SegmentTree *tree;
         DataLoader *storage;
-        std::vector<std::vector<std::vector<std::pair<float, int>>>> edges;
+        // layers[d] holds the lists of all points at depth d; leaves have none
+        std::vector<std::unique_ptr<LayerEdges>> layers;
+        // chunks of a layer hold at least this many points, unless a whole parent node holds more
+        long long min_chunk_points = 1 << 12;
+        // when set, the lists are streamed to disk and freed as soon as they are final
+        IndexWriter *writer_{nullptr};
+        // set by appendandsave: points before appended_from_ are already indexed, and the old tree sits
+        // grown_layers_ levels below the new root
+        int appended_from_{0};
+        int grown_layers_{0};
+        // attribute keys of the points, saved with the index when set (see SetAttributes)
+        AttributeType attribute_type_{kAttributeNone};
+        std::vector<int64_t> attribute_keys_;
         std::vector<std::vector<PFI>> reverse_edges;
         size_t M;
         size_t ef_construction;
@@ -25,25 +246,34 @@ namespace iRangeGraph
         hnswlib::L2Space *space;
         hnswlib::DISTFUNC<dist_t> fstdistfunc_;
         void *dist_func_param_{nullptr};
-        std::vector<size_t> visitedpool;
-        size_t visited_tag{0};
-        std::mutex tag_mutex;
-
-        std::queue<int> threadidpool;
-
-        iRangeGraph_Build(DataLoader *store, int M_out = 32, int ef_c = 400) : storage(store), M(M_out), ef_construction(ef_c)
+        // one context per pool worker, plus a last one for calls made from outside the pool
+        std::vector<BuildContext> contexts;
+
+        // nodes with at least this many points merge their children with all workers
+        size_t parallel_merge_threshold = 1 << 15;
+        scheduler::WorkStealingPool *pool_{nullptr};
+        static constexpr int reverse_lock_num = 4096;
+        std::mutex reverse_locks[reverse_lock_num];
+
+        // fanout is the number of children of every tree node: a larger fan-out gives fewer layers, hence less link
+        // memory per point and shorter walks down the tree, at the cost of merging more children per node.
+        // Nodes of at most leaf_size points get no graph layer; searches scan them.
+        iRangeGraph_Build(DataLoader *store, int M_out = 32, int ef_c = 400, int fanout = 2, int leaf_size = 1) : storage(store), M(M_out), ef_construction(ef_c)
         {
             space = new hnswlib::L2Space(storage->Dim);
             fstdistfunc_ = space->get_dist_func();
             dist_func_param_ = space->get_dist_func_param();
-            tree = new SegmentTree(storage->data_nb);
-            tree->BuildTree(tree->root);
-            edges.resize(storage->data_nb);
-            for (int i = 0; i < storage->data_nb; i++)
-            {
-                edges[i].resize(tree->max_depth + 1);
-            }
-            visitedpool.resize(storage->data_nb);
+            tree = new SegmentTree(storage->data_nb, fanout, leaf_size);
+            layers.resize(tree->max_depth + 1);
+            contexts.resize(1);
+        }
+
+        BuildContext &get_context()
+        {
+            int worker = pool_ == nullptr ? -1 : pool_->worker_index();
+            if (worker < 0)
+                return contexts.back();
+            return contexts[worker];
         }
 
         float dis_compute(std::vector<float> &v1, std::vector<float> &v2)
@@ -51,110 +281,135 @@ namespace iRangeGraph
             return fstdistfunc_(v1.data(), v2.data(), dist_func_param_);
         }
 
-        void copyfirstchild(TreeNode *u)
+        // A chunk of a layer holds the points of one node of the parent layer, or of a higher one while those
+        // nodes are small, so it is final as soon as the parent nodes in it are merged.
+        long long chunk_span(int layer) const
         {
-            TreeNode *firstchild = u->childs[0];
-            for (int id = firstchild->lbound; id <= firstchild->rbound; id++)
-            {
-                int lower_layer = firstchild->depth;
-                int higher_layer = u->depth;
-                edges[id][higher_layer] = edges[id][lower_layer];
-            }
+            int depth = std::max(layer - 1, 0);
+            while (depth > 0 && tree->node_span(depth) < min_chunk_points)
+                depth--;
+            return tree->node_span(depth);
         }
 
-        std::priority_queue<PFI> search_on_incomplete_graph(TreeNode *u, std::vector<float> &query_point, int ef, int query_k, std::vector<int> enterpoints)
+        std::unique_ptr<LayerEdges> new_layer(int layer) const
         {
-            size_t local_tag;
-            {
-                std::lock_guard<std::mutex> lock(tag_mutex);
-                visited_tag++;
-                local_tag = visited_tag;
-            }
+            return std::unique_ptr<LayerEdges>(new LayerEdges(storage->data_nb, list_width(layer), chunk_span(layer)));
+        }
+
+        // a list links a point to other points of its node, so it has at most node span - 1 entries
+        size_t list_width(int layer) const
+        {
+            return std::min<long long>(M, tree->node_span(layer) - 1);
+        }
+
+        void copyfirstchild(const TreeNode &u)
+        {
+            TreeNode firstchild = tree->child(u, 0);
+            if (layers[firstchild.depth] == nullptr)
+                return;
+            layers[u.depth]->copy_range(*layers[firstchild.depth], firstchild.lbound, firstchild.rbound);
+        }
 
-            std::priority_queue<PFI, std::vector<PFI>, std::greater<PFI>> pool;
-            std::priority_queue<PFI> candidates;
+        // Returns the query_k closest points found, as a max-heap in ctx.candidates.
+        std::vector<PFI> &search_on_incomplete_graph(BuildContext &ctx, const TreeNode &u, std::vector<float> &query_point, int ef, int query_k)
+        {
+            ctx.begin(u.lbound, u.rbound - u.lbound + 1);
+            auto &pool = ctx.pool;
+            auto &candidates = ctx.candidates;
+            auto closer = std::greater<PFI>();
 
-            for (auto pid : enterpoints)
+            for (auto pid : ctx.enterpoints)
             {
+                if (ctx.is_visited(pid))
+                    continue;
+                ctx.set_visited(pid);
                 float dis = dis_compute(query_point, storage->data_points[pid]);
-                visitedpool[pid] = local_tag;
-                pool.emplace(dis, pid);
-                candidates.emplace(dis, pid);
+                pool.emplace_back(dis, pid);
+                std::push_heap(pool.begin(), pool.end(), closer);
+                candidates.emplace_back(dis, pid);
+                std::push_heap(candidates.begin(), candidates.end());
             }
 
-            float lowerBound = candidates.top().first;
+            float lowerBound = candidates.front().first;
 
-            int layer = u->depth;
+            const LayerEdges &edges = *layers[u.depth];
 
             while (!pool.empty())
             {
-                auto current_pair = pool.top();
+                auto current_pair = pool.front();
                 if (current_pair.first > lowerBound)
                     break;
-                pool.pop();
+                std::pop_heap(pool.begin(), pool.end(), closer);
+                pool.pop_back();
                 int current_pointId = current_pair.second;
-                size_t size = edges[current_pointId][layer].size();
+                size_t size = edges.size(current_pointId);
+                const int *neighbors = edges.neighbors(current_pointId);
 
-                for (int i = 0; i < size; i++)
+                for (size_t i = 0; i < size; i++)
                 {
-                    int neighborId = edges[current_pointId][layer][i].second;
-                    if (visitedpool[neighborId] == local_tag)
+                    int neighborId = neighbors[i];
+                    if (ctx.is_visited(neighborId))
                         continue;
-                    visitedpool[neighborId] = local_tag;
+                    ctx.set_visited(neighborId);
                     float dis = dis_compute(query_point, storage->data_points[neighborId]);
-                    if (candidates.size() < ef || dis < lowerBound)
+                    if (candidates.size() < (size_t)ef || dis < lowerBound)
                     {
-                        candidates.emplace(dis, neighborId);
-                        pool.emplace(dis, neighborId);
+                        candidates.emplace_back(dis, neighborId);
+                        std::push_heap(candidates.begin(), candidates.end());
+                        pool.emplace_back(dis, neighborId);
+                        std::push_heap(pool.begin(), pool.end(), closer);
 
-                        if (candidates.size() > ef)
-                        {
-                            candidates.pop();
-                        }
-                        if (candidates.size())
+                        if (candidates.size() > (size_t)ef)
                         {
-                            lowerBound = candidates.top().first;
+                            std::pop_heap(candidates.begin(), candidates.end());
+                            candidates.pop_back();
                         }
+                        lowerBound = candidates.front().first;
                     }
                 }
             }
 
-            while (candidates.size() > query_k)
-                candidates.pop();
+            while (candidates.size() > (size_t)query_k)
+            {
+                std::pop_heap(candidates.begin(), candidates.end());
+                candidates.pop_back();
+            }
             return candidates;
         }
 
-        std::vector<PFI> PruneByHeuristic2(std::vector<PFI> &old_list, std::vector<PFI> &new_list)
+        // Selects at most M neighbors out of ctx.old_list (the lower-layer list) and ctx.new_list into ctx.pruned.
+        void PruneByHeuristic2(BuildContext &ctx)
         {
-            std::priority_queue<PFI, std::vector<PFI>, std::greater<PFI>> queue_closest;
-            std::vector<PFI> return_list;
-            std::vector<bool> return_list_belong_to_lowerlayer_list;
-            for (auto t : old_list)
-                queue_closest.emplace(t);
-            for (auto t : new_list)
-                queue_closest.emplace(t);
+            auto &queue_closest = ctx.pool;
+            auto &return_list = ctx.pruned;
+            auto &return_list_belong_to_lowerlayer_list = ctx.pruned_from_old;
+            auto closer = std::greater<PFI>();
+            queue_closest.clear();
+            return_list.clear();
+            return_list_belong_to_lowerlayer_list.clear();
+            queue_closest.insert(queue_closest.end(), ctx.old_list.begin(), ctx.old_list.end());
+            queue_closest.insert(queue_closest.end(), ctx.new_list.begin(), ctx.new_list.end());
             if (queue_closest.size() <= M)
             {
-                while (queue_closest.size())
-                {
-                    return_list.emplace_back(queue_closest.top());
-                    queue_closest.pop();
-                }
-                return return_list;
+                std::sort(queue_closest.begin(), queue_closest.end());
+                return_list.swap(queue_closest);
+                return;
             }
+            std::make_heap(queue_closest.begin(), queue_closest.end(), closer);
 
             while (queue_closest.size())
             {
                 if (return_list.size() >= M)
                     break;
 
-                auto current_pair = queue_closest.top();
+                auto current_pair = queue_closest.front();
                 float dist_to_pid = current_pair.first;
-                queue_closest.pop();
+                std::pop_heap(queue_closest.begin(), queue_closest.end(), closer);
+                queue_closest.pop_back();
 
                 bool good = true;
                 bool current_old = false;
-                for (auto t : old_list)
+                for (auto t : ctx.old_list)
                 {
                     if (t.second == current_pair.second)
                     {
@@ -162,7 +417,7 @@ namespace iRangeGraph
                         break;
                     }
                 }
-                for (int i = 0; i < return_list.size(); i++)
+                for (size_t i = 0; i < return_list.size(); i++)
                 {
                     if (current_old && return_list_belong_to_lowerlayer_list[i])
                         continue;
@@ -180,141 +435,442 @@ namespace iRangeGraph
                     return_list_belong_to_lowerlayer_list.emplace_back(current_old);
                 }
             }
-            return return_list;
         }
 
-        void process_node(TreeNode *u)
+        // Lists loaded from an existing index carry no distances; they are recomputed the first time a list is
+        // pruned again.
+        void restore_distances(int pid, int layer)
         {
-            if (u->childs.size() == 0)
+            LayerEdges &edges = *layers[layer];
+            int size = edges.size(pid);
+            if (size == 0)
                 return;
+            float *dists = edges.distances(pid);
+            if (!std::isnan(dists[0]))
+                return;
+            const int *ids = edges.neighbors(pid);
+            for (int i = 0; i < size; i++)
+                dists[i] = dis_compute(storage->data_points[pid], storage->data_points[ids[i]]);
+        }
 
-            copyfirstchild(u);
-            int merged_point_num = u->childs[0]->rbound - u->childs[0]->lbound + 1;
-            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-            std::default_random_engine e(seed);
-
-            for (int i = 1; i < u->childs.size(); i++)
+        void load_list(std::vector<PFI> &list, int pid, int layer)
+        {
+            if (layers[layer] == nullptr)
             {
-                std::uniform_int_distribution<int> u_start(0, merged_point_num - 1);
-                TreeNode *cur_child = u->childs[i];
-                for (int pid = cur_child->lbound; pid <= cur_child->rbound; pid++)
-                {
-                    std::vector<int> enterpoints;
-                    for (int i = 0; i < std::min(3, merged_point_num); i++)
-                    {
-                        int enterpid = u_start(e) + u->lbound;
-                        enterpoints.emplace_back(enterpid);
-                    }
+                list.clear();
+                return;
+            }
+            restore_distances(pid, layer);
+            layers[layer]->get(pid, list);
+        }
 
-                    auto search_result = search_on_incomplete_graph(u, storage->data_points[pid], ef_construction, ef_construction, enterpoints);
-                    while (search_result.size())
-                    {
-                        edges[pid][u->depth].emplace_back(search_result.top());
-                        search_result.pop();
-                    }
-                    edges[pid][u->depth] = PruneByHeuristic2(edges[pid][cur_child->depth], edges[pid][u->depth]);
-                }
+        bool merge_in_parallel(const TreeNode &u)
+        {
+            return pool_ != nullptr && pool_->size() > 1 && (size_t)(u.rbound - u.lbound + 1) >= parallel_merge_threshold;
+        }
+
+        // Large nodes (the top few layers) would otherwise leave all but one worker idle, so their passes are
+        // split into chunks that run on the pool.
+        template <typename Func>
+        void for_chunks(size_t lo, size_t hi, bool parallel, Func func)
+        {
+            if (!parallel)
+            {
+                func(lo, hi);
+                return;
+            }
+            size_t grain = std::max<size_t>(256, (hi - lo) / (pool_->size() * 8));
+            pool_->parallel_for(lo, hi, grain, func);
+        }
 
-                for (int j = 0; j < merged_point_num; j++)
+        // Inserts the points [lo, hi) of cur_child into the layer of u: each keeps its list from the child layer
+        // and is linked to what a search over the merged children u.lbound .. cur_child.lbound - 1 finds.
+        // Searches only read lists of merged points, which no concurrent chunk writes to.
+        void insert_child_points(const TreeNode &u, const TreeNode &cur_child, int lo, int hi, std::default_random_engine &e)
+        {
+            BuildContext &ctx = get_context();
+            int merged_point_num = cur_child.lbound - u.lbound;
+            std::uniform_int_distribution<int> u_start(0, merged_point_num - 1);
+            for (int pid = lo; pid < hi; pid++)
+            {
+                ctx.enterpoints.clear();
+                for (int i = 0; i < std::min(3, merged_point_num); i++)
                 {
-                    int pid = u->lbound + j;
-                    reverse_edges[pid].clear();
+                    int enterpid = u_start(e) + u.lbound;
+                    ctx.enterpoints.emplace_back(enterpid);
                 }
 
-                for (int pid = cur_child->lbound; pid <= cur_child->rbound; pid++)
+                auto &search_result = search_on_incomplete_graph(ctx, u, storage->data_points[pid], ef_construction, ef_construction);
+                ctx.new_list.clear();
+                for (auto &t : search_result)
                 {
-                    for (auto neighbor_pair : edges[pid][u->depth])
-                    {
-                        int neighborId = neighbor_pair.second;
-                        if (neighborId < cur_child->lbound)
-                        {
-                            reverse_edges[neighborId].emplace_back(neighbor_pair.first, pid);
-                        }
-                    }
+                    if (t.second < cur_child.lbound)
+                        ctx.new_list.emplace_back(t);
                 }
+                load_list(ctx.old_list, pid, cur_child.depth);
+                PruneByHeuristic2(ctx);
+                layers[u.depth]->set(pid, ctx.pruned);
+            }
+        }
+
+        void prune_reverse_edges(int pid, int layer)
+        {
+            BuildContext &ctx = get_context();
+            load_list(ctx.old_list, pid, layer);
+            ctx.new_list.assign(reverse_edges[pid].begin(), reverse_edges[pid].end());
+            PruneByHeuristic2(ctx);
+            layers[layer]->set(pid, ctx.pruned);
+        }
+
+        // Turns the edges from [lo, hi) into the merged children into reverse edges and re-prunes only the lists
+        // that received one.
+        void add_reverse_edges(const TreeNode &u, const TreeNode &cur_child, int lo, int hi, bool parallel)
+        {
+            LayerEdges &edges = *layers[u.depth];
+            std::vector<int> touched;
+            std::mutex touched_mutex;
+            for_chunks(lo, hi, parallel, [&](size_t chunk_lo, size_t chunk_hi)
+                       {
+                           std::vector<int> local_touched;
+                           for (int pid = chunk_lo; pid < (int)chunk_hi; pid++)
+                           {
+                               for (int k = 0; k < edges.size(pid); k++)
+                               {
+                                   int neighborId = edges.neighbors(pid)[k];
+                                   if (neighborId < cur_child.lbound)
+                                   {
+                                       std::lock_guard<std::mutex> lock(reverse_locks[neighborId % reverse_lock_num]);
+                                       if (reverse_edges[neighborId].empty())
+                                           local_touched.emplace_back(neighborId);
+                                       reverse_edges[neighborId].emplace_back(edges.distances(pid)[k], pid);
+                                   }
+                               }
+                           }
+                           std::lock_guard<std::mutex> lock(touched_mutex);
+                           touched.insert(touched.end(), local_touched.begin(), local_touched.end()); });
+
+            for_chunks(0, touched.size(), parallel, [&](size_t chunk_lo, size_t chunk_hi)
+                       {
+                           for (size_t i = chunk_lo; i < chunk_hi; i++)
+                           {
+                               prune_reverse_edges(touched[i], u.depth);
+                               std::vector<PFI>().swap(reverse_edges[touched[i]]);
+                           } });
+        }
+
+        // Merges the points [lo, cur_child.rbound] of cur_child into the children of u on its left.
+        void merge_child(const TreeNode &u, const TreeNode &cur_child, int lo, bool parallel, unsigned seed)
+        {
+            for_chunks(lo, cur_child.rbound + 1, parallel, [&](size_t chunk_lo, size_t chunk_hi)
+                       {
+                           std::default_random_engine e(seed + chunk_lo);
+                           insert_child_points(u, cur_child, chunk_lo, chunk_hi, e); });
+            add_reverse_edges(u, cur_child, lo, cur_child.rbound + 1, parallel);
+        }
+
+        // The children of a bottom node are buckets of several points without a graph, so its layer is built
+        // exactly: every point is linked to its ef_construction closest points in the node, pruned by the usual
+        // heuristic.
+        void process_bottom_node(const TreeNode &u)
+        {
+            LayerEdges &edges = *layers[u.depth];
+            for_chunks(u.lbound, u.rbound + 1, merge_in_parallel(u), [&](size_t lo, size_t hi)
+                       {
+                           BuildContext &ctx = get_context();
+                           ctx.old_list.clear();
+                           for (int pid = lo; pid < (int)hi; pid++)
+                           {
+                               ctx.new_list.clear();
+                               for (int other = u.lbound; other <= u.rbound; other++)
+                               {
+                                   if (other != pid)
+                                       ctx.new_list.emplace_back(dis_compute(storage->data_points[pid], storage->data_points[other]), other);
+                               }
+                               if (ctx.new_list.size() > ef_construction)
+                               {
+                                   std::nth_element(ctx.new_list.begin(), ctx.new_list.begin() + ef_construction, ctx.new_list.end());
+                                   ctx.new_list.resize(ef_construction);
+                               }
+                               PruneByHeuristic2(ctx);
+                               edges.set(pid, ctx.pruned);
+                           } });
+        }
+
+        // With leaf_size 1 the leaves are single points, and the nodes above them are merged like any other.
+        bool is_bottom(const TreeNode &u) const { return tree->leaf_size_ > 1 && u.depth + 1 == tree->max_depth; }
+
+        void process_node(const TreeNode &u)
+        {
+            if (tree->is_leaf(u))
+                return;
+
+            copyfirstchild(u);
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            bool parallel = merge_in_parallel(u);
+
+            for (int i = 1; i < tree->child_num(u); i++)
+            {
+                TreeNode cur_child = tree->child(u, i);
+                merge_child(u, cur_child, cur_child.lbound, parallel, seed);
+            }
+        }
+
+        // Re-merges a node of the existing index that now also holds appended points. The lists of its old
+        // points at this layer are kept: new points are merged the way process_node would merge them, and old
+        // points of the child that received new points pick up the new neighbors they gained one layer below.
+        void process_spine_node(const TreeNode &u)
+        {
+            int first_new = appended_from_;
+            LayerEdges &edges = *layers[u.depth];
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            bool parallel = merge_in_parallel(u);
+
+            int i = 0;
+            while (tree->child(u, i).rbound < first_new)
+                i++;
+            TreeNode spine = tree->child(u, i);
+            if (spine.lbound < first_new)
+            {
+                if (i == 0 && layers[spine.depth] != nullptr)
+                    edges.copy_range(*layers[spine.depth], first_new, spine.rbound);
+                else if (i > 0)
+                    merge_child(u, spine, first_new, parallel, seed);
 
-                for (int j = 0; j < merged_point_num; j++)
+                if (layers[spine.depth] != nullptr)
                 {
-                    int pid = u->lbound + j;
-                    edges[pid][u->depth] = PruneByHeuristic2(edges[pid][u->depth], reverse_edges[pid]);
+                    LayerEdges &lower = *layers[spine.depth];
+                    for_chunks(spine.lbound, first_new, parallel, [&](size_t lo, size_t hi)
+                               {
+                                   BuildContext &ctx = get_context();
+                                   for (int pid = lo; pid < (int)hi; pid++)
+                                   {
+                                       restore_distances(pid, spine.depth);
+                                       ctx.new_list.clear();
+                                       for (int k = 0; k < lower.size(pid); k++)
+                                       {
+                                           int neighborId = lower.neighbors(pid)[k];
+                                           if (neighborId >= first_new)
+                                               ctx.new_list.emplace_back(lower.distances(pid)[k], neighborId);
+                                       }
+                                       if (ctx.new_list.empty())
+                                           continue;
+                                       load_list(ctx.old_list, pid, u.depth);
+                                       PruneByHeuristic2(ctx);
+                                       edges.set(pid, ctx.pruned);
+                                   } });
                 }
+                i++;
+            }
 
-                merged_point_num += cur_child->rbound - cur_child->lbound + 1;
+            for (; i < tree->child_num(u); i++)
+            {
+                TreeNode cur_child = tree->child(u, i);
+                merge_child(u, cur_child, cur_child.lbound, parallel, seed);
             }
         }
 
+        // Hands a chunk of final lists to the writer, which frees it once written.
+        void write_chunk(int layer, size_t index)
+        {
+            std::shared_ptr<LayerEdges::Chunk> chunk = layers[layer]->release(index);
+            if (chunk != nullptr)
+                writer_->push(layer, chunk->lbound, chunk->count, chunk, chunk->sizes, chunk->ids, layers[layer]->width);
+        }
+
+        // Once u is merged, nothing reads the lists of its children any more unless another parent node in
+        // their chunk still merges.
+        void release_child_lists(const TreeNode &u)
+        {
+            if (writer_ == nullptr || u.depth == tree->max_depth || layers[u.depth + 1] == nullptr)
+                return;
+            LayerEdges &edges = *layers[u.depth + 1];
+            size_t index = edges.chunk_index(u.lbound);
+            if (--edges.pending[index] == 0)
+                write_chunk(u.depth + 1, index);
+        }
+
+        // Nodes whose lists are missing: all of them for a fresh build, only those holding appended points otherwise.
+        bool is_dirty(const TreeNode &u) const { return u.rbound >= appended_from_; }
+
+        bool is_spine(const TreeNode &u) const { return u.lbound < appended_from_ && u.depth >= grown_layers_; }
+
+        // Each node becomes runnable as soon as all of its children are merged, so a worker never waits on
+        // unrelated nodes of the same layer. Tasks spawned by a worker stay on its own deque, which keeps a
+        // finished subtree and its parent on the same core; idle workers steal from the others.
         void buildindex()
         {
-            std::vector<std::vector<TreeNode *>> level_nodes;
-            level_nodes.resize(tree->max_depth + 1);
-            for (auto node : tree->treenodes)
+            size_t node_num = tree->node_num();
+            std::vector<std::atomic<int>> pending_childs(node_num);
+            std::vector<std::atomic<size_t>> layer_remaining(tree->max_depth + 1);
+            for (int depth = 0; depth < tree->max_depth; depth++)
             {
-                level_nodes[node->depth].emplace_back(node);
+                if (layers[depth] == nullptr)
+                    layers[depth] = new_layer(depth);
             }
-            for (int layer = tree->max_depth; layer >= 0; layer--)
+            for (int depth = 0; depth <= tree->max_depth; depth++)
             {
-                std::cout << "building for layer " << layer << std::endl;
-                std::vector<std::thread> threads;
-
-                for (int i = 0; i < level_nodes[layer].size(); i++)
+                for (long long index = 0; index < tree->level_size(depth); index++)
                 {
-                    if (threads.size() >= max_threads)
+                    TreeNode node = tree->node(depth, index);
+                    if (!is_dirty(node))
+                        continue;
+                    layer_remaining[depth]++;
+                    if (depth < tree->max_depth && layers[depth + 1] != nullptr)
+                        layers[depth + 1]->pending[layers[depth + 1]->chunk_index(node.lbound)]++;
+                    for (int i = 0; i < tree->child_num(node); i++)
                     {
-                        for (auto &thread : threads)
-                        {
-                            if (thread.joinable())
-                            {
-                                thread.join();
-                            }
-                        }
-                        threads.clear();
+                        if (is_dirty(tree->child(node, i)))
+                            pending_childs[tree->node_id(node)]++;
                     }
-                    TreeNode *u = level_nodes[layer][i];
-                    threads.emplace_back(std::thread(&iRangeGraph_Build<dist_t>::process_node, this, u));
                 }
-                for (auto &thread : threads)
+            }
+            // lists that no merge reads, loaded from an index being appended to, are written out right away
+            if (writer_ != nullptr)
+            {
+                for (int depth = 1; depth <= tree->max_depth; depth++)
                 {
-                    if (thread.joinable())
+                    for (size_t index = 0; layers[depth] != nullptr && index < layers[depth]->chunk_num(); index++)
                     {
-                        thread.join();
+                        if (layers[depth]->pending[index] == 0)
+                            write_chunk(depth, index);
                     }
                 }
+            }
 
-                threads.clear();
+            std::mutex print_mutex;
+            scheduler::WorkStealingPool pool(max_threads);
+            contexts.resize(pool.size() + 1);
+            pool_ = &pool;
+            std::function<void(TreeNode)> run_node = [&](TreeNode u)
+            {
+                if (is_bottom(u))
+                    process_bottom_node(u);
+                else if (!tree->is_leaf(u) && is_spine(u))
+                    process_spine_node(u);
+                else
+                    process_node(u);
+                release_child_lists(u);
+                if (--layer_remaining[u.depth] == 0)
+                {
+                    std::lock_guard<std::mutex> lock(print_mutex);
+                    std::cout << "finished layer " << u.depth << std::endl;
+                }
+                if (u.depth == 0)
+                    return;
+                TreeNode p = tree->parent(u);
+                if (--pending_childs[tree->node_id(p)] == 0)
+                    pool.submit([&run_node, p]
+                                { run_node(p); });
+            };
+
+            // leaves are handed out in contiguous blocks so that sibling subtrees start on the same worker
+            std::vector<TreeNode> leaves;
+            for (long long index = 0; index < tree->level_size(tree->max_depth); index++)
+            {
+                TreeNode node = tree->node(tree->max_depth, index);
+                if (is_dirty(node))
+                    leaves.emplace_back(node);
+            }
+            size_t block = (leaves.size() + pool.size() - 1) / pool.size();
+            for (size_t i = 0; i < leaves.size(); i++)
+            {
+                TreeNode u = leaves[i];
+                pool.submit([&run_node, u]
+                            { run_node(u); },
+                            i / block);
+            }
+            pool.wait_idle();
+            pool_ = nullptr;
+            // the root layer has no parent to wait for
+            if (writer_ != nullptr && layers[0] != nullptr)
+            {
+                for (size_t index = 0; index < layers[0]->chunk_num(); index++)
+                    write_chunk(0, index);
             }
         }
 
+        // Saves the attribute value of every point with the index, as keys read by LoadAttributeFile, so searches
+        // can take ranges of values.
+        void SetAttributes(AttributeType type, std::vector<int64_t> keys)
+        {
+            if (keys.size() != (size_t)storage->data_nb)
+                throw Exception("there should be one attribute value per data point");
+            attribute_type_ = type;
+            attribute_keys_ = std::move(keys);
+        }
+
         void buildandsave(std::string indexpath)
         {
-            CheckPath(indexpath);
-            std::ofstream indexfile(indexpath, std::ios::out | std::ios::binary);
-            if (!indexfile.is_open())
-                throw Exception("cannot open " + indexpath);
+            IndexWriter writer(indexpath, *tree, storage->data_nb, storage->Dim, M, attribute_type_);
+            writer.push_vectors(&storage->data_points);
+            if (attribute_type_ != kAttributeNone)
+                writer.push_attributes(&attribute_keys_);
             reverse_edges.resize(storage->data_nb);
             timeval t1, t2;
             gettimeofday(&t1, NULL);
+            writer_ = &writer;
             buildindex();
+            writer_ = nullptr;
             gettimeofday(&t2, NULL);
             double construction_time = GetTime(t1, t2);
 
             std::cout << "construction time:" << construction_time << "s" << std::endl;
 
-            for (int pid = 0; pid < storage->data_nb; pid++)
+            writer.finish();
+            std::cout << "save index done" << std::endl;
+        }
+
+        // Extends the index at oldindexpath, built over the first points of storage, with the points appended
+        // after them and saves the result to indexpath. Only the subtrees of the new points are built, and the
+        // nodes along the right spine of the tree re-merge just the new points into their existing lists.
+        void appendandsave(std::string oldindexpath, std::string indexpath)
+        {
+            IndexReader reader(oldindexpath);
+            int old_nb = reader.header.nb;
+            if (old_nb <= 0 || old_nb >= storage->data_nb)
+                throw Exception("the data should hold the " + std::to_string(old_nb) + " indexed points followed by the new ones");
+            if (reader.header.dim != (uint32_t)storage->Dim)
+                throw Exception("index is built over " + std::to_string(reader.header.dim) + "-dimensional data, but the data has " + std::to_string(storage->Dim) + " dimensions");
+            if (reader.header.M != M)
+                throw Exception("index is built with M = " + std::to_string(reader.header.M) + ", but M = " + std::to_string(M) + " is given");
+            if (reader.header.fanout != (uint32_t)tree->ways_)
+                throw Exception("index is built with fan-out " + std::to_string(reader.header.fanout) + ", but fan-out " + std::to_string(tree->ways_) + " is given");
+            if (reader.header.leaf_size != (uint32_t)tree->leaf_size_)
+                throw Exception("index is built with leaf size " + std::to_string(reader.header.leaf_size) + ", but leaf size " + std::to_string(tree->leaf_size_) + " is given");
+            SegmentTree old_tree(old_nb, tree->ways_, tree->leaf_size_);
+            if (reader.header.layer_num != (uint32_t)old_tree.height + 1)
+                throw Exception(oldindexpath + " does not match the tree over " + std::to_string(old_nb) + " points");
+            if (reader.header.attribute_type != attribute_type_)
+                throw Exception(attribute_type_ == kAttributeNone ? oldindexpath + " holds attribute values; give the values of all points"
+                                                                  : "the attribute type does not match " + oldindexpath);
+            std::vector<int64_t> old_keys;
+            if (reader.read_attributes(old_keys) && !std::equal(old_keys.begin(), old_keys.end(), attribute_keys_.begin()))
+                throw Exception("the attribute values of the indexed points differ from those in " + oldindexpath);
+
+            // when the root span grows, the old root becomes the first descendant of the new one
+            appended_from_ = old_nb;
+            grown_layers_ = tree->max_depth - old_tree.height;
+            for (int layer = 0; layer < (int)reader.header.layer_num; layer++)
             {
-                for (int layer = 0; layer <= tree->max_depth; layer++)
-                {
-                    int size = edges[pid][layer].size();
-                    indexfile.write((char *)&size, sizeof(int));
-                    for (int i = 0; i < size; i++)
-                    {
-                        int neighborId = edges[pid][layer][i].second;
-                        indexfile.write((char *)&neighborId, sizeof(int));
-                    }
-                }
+                std::unique_ptr<LayerEdges> edges = new_layer(layer + grown_layers_);
+                bool found = reader.read_layer(layer, [&](size_t pid, const int *record)
+                                               {
+                                                   if ((size_t)record[0] > edges->width)
+                                                       throw Exception(oldindexpath + " holds a list longer than its node");
+                                                   if (record[0] == 0)
+                                                       return;
+                                                   std::memcpy(edges->neighbors(pid), record + 1, record[0] * sizeof(int));
+                                                   std::fill(edges->distances(pid), edges->distances(pid) + record[0], std::numeric_limits<float>::quiet_NaN());
+                                                   edges->set_size(pid, record[0]); });
+                if (!found)
+                    continue;
+                layers[layer + grown_layers_] = std::move(edges);
             }
+            std::cout << "appending " << storage->data_nb - old_nb << " points to " << old_nb << " indexed points" << std::endl;
 
-            std::cout << "save index done" << std::endl;
-            indexfile.close();
+            buildandsave(indexpath);
+            appended_from_ = 0;
+            grown_layers_ = 0;
         }
     };
 
@@ -0,0 +1,283 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "scheduler.hpp"
+
+namespace diskio
+{
+    constexpr size_t kSectorBytes = 4096;
+
+    struct ReadRequest
+    {
+        uint64_t offset;
+        size_t bytes;
+        void *buffer;
+    };
+
+    // Minimal io_uring submission/completion ring driven through the raw system calls.
+    class IoUring
+    {
+    public:
+        // Returns nullptr when the kernel (or a seccomp filter) does not allow io_uring.
+        static std::unique_ptr<IoUring> Create(unsigned entries)
+        {
+            std::unique_ptr<IoUring> ring(new IoUring());
+            if (!ring->init(entries))
+                return nullptr;
+            return ring;
+        }
+
+        ~IoUring()
+        {
+            if (sqes_ != nullptr)
+                munmap(sqes_, sqes_bytes_);
+            if (cq_ptr_ != nullptr && cq_ptr_ != sq_ptr_)
+                munmap(cq_ptr_, cq_bytes_);
+            if (sq_ptr_ != nullptr)
+                munmap(sq_ptr_, sq_bytes_);
+            if (ring_fd_ >= 0)
+                close(ring_fd_);
+        }
+
+        unsigned entries() const { return entries_; }
+
+        // Queues a read of request i; at most entries() reads may be in flight.
+        void prepare(int fd, const ReadRequest &request, uint64_t i)
+        {
+            unsigned tail = *sq_tail_;
+            unsigned index = tail & *sq_mask_;
+            io_uring_sqe *sqe = sqes_ + index;
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = fd;
+            sqe->off = request.offset;
+            sqe->addr = (uint64_t)request.buffer;
+            sqe->len = request.bytes;
+            sqe->user_data = i;
+            sq_array_[index] = index;
+            __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        // Submits the queued reads and waits until at least min_complete have completed.
+        void enter(unsigned to_submit, unsigned min_complete)
+        {
+            while (true)
+            {
+                int ret = syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, IORING_ENTER_GETEVENTS, nullptr, 0);
+                if (ret >= 0)
+                    return;
+                if (errno != EINTR)
+                    throw std::runtime_error(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            }
+        }
+
+        // Calls func(user_data, result) for every completed read.
+        template <typename Func>
+        unsigned reap(Func func)
+        {
+            unsigned head = *cq_head_;
+            unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+            unsigned reaped = 0;
+            for (; head != tail; head++, reaped++)
+            {
+                io_uring_cqe *cqe = cqes_ + (head & *cq_mask_);
+                func(cqe->user_data, cqe->res);
+            }
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            return reaped;
+        }
+
+    private:
+        int ring_fd_{-1};
+        unsigned entries_{0};
+        void *sq_ptr_{nullptr}, *cq_ptr_{nullptr};
+        size_t sq_bytes_{0}, cq_bytes_{0}, sqes_bytes_{0};
+        unsigned *sq_tail_{nullptr}, *sq_mask_{nullptr}, *sq_array_{nullptr};
+        unsigned *cq_head_{nullptr}, *cq_tail_{nullptr}, *cq_mask_{nullptr};
+        io_uring_sqe *sqes_{nullptr};
+        io_uring_cqe *cqes_{nullptr};
+
+        IoUring() {}
+
+        bool init(unsigned entries)
+        {
+            io_uring_params params;
+            std::memset(&params, 0, sizeof(params));
+            ring_fd_ = syscall(__NR_io_uring_setup, entries, &params);
+            if (ring_fd_ < 0)
+                return false;
+            entries_ = params.sq_entries;
+
+            sq_bytes_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cq_bytes_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single_mmap)
+                sq_bytes_ = cq_bytes_ = std::max(sq_bytes_, cq_bytes_);
+            sq_ptr_ = mmap(nullptr, sq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQ_RING);
+            if (sq_ptr_ == MAP_FAILED)
+            {
+                sq_ptr_ = nullptr;
+                return false;
+            }
+            cq_ptr_ = single_mmap ? sq_ptr_ : mmap(nullptr, cq_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_CQ_RING);
+            if (cq_ptr_ == MAP_FAILED)
+            {
+                cq_ptr_ = nullptr;
+                return false;
+            }
+            sqes_bytes_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = (io_uring_sqe *)mmap(nullptr, sqes_bytes_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+            if (sqes_ == MAP_FAILED)
+            {
+                sqes_ = nullptr;
+                return false;
+            }
+
+            char *sq = (char *)sq_ptr_, *cq = (char *)cq_ptr_;
+            sq_tail_ = (unsigned *)(sq + params.sq_off.tail);
+            sq_mask_ = (unsigned *)(sq + params.sq_off.ring_mask);
+            sq_array_ = (unsigned *)(sq + params.sq_off.array);
+            cq_head_ = (unsigned *)(cq + params.cq_off.head);
+            cq_tail_ = (unsigned *)(cq + params.cq_off.tail);
+            cq_mask_ = (unsigned *)(cq + params.cq_off.ring_mask);
+            cqes_ = (io_uring_cqe *)(cq + params.cq_off.cqes);
+            return true;
+        }
+    };
+
+    // Reads batches of sector-aligned blocks from one file, bypassing the page cache when the file system allows
+    // O_DIRECT. A batch goes through io_uring when available and is otherwise spread over a pool of threads doing
+    // pread. Reads the ring fails or cuts short are finished by the pool. Not thread safe: use one reader per
+    // searching thread.
+    class BlockReader
+    {
+    public:
+        BlockReader(std::string path, unsigned queue_depth = 128, size_t threads = 8)
+        {
+            fd_ = open(path.c_str(), O_RDONLY | O_DIRECT);
+            direct_ = fd_ >= 0 && probe_direct();
+            if (!direct_)
+            {
+                if (fd_ >= 0)
+                    close(fd_);
+                fd_ = open(path.c_str(), O_RDONLY);
+            }
+            if (fd_ < 0)
+                throw std::runtime_error("cannot open " + path);
+            threads_ = threads;
+            ring_ = IoUring::Create(queue_depth);
+        }
+
+        ~BlockReader()
+        {
+            close(fd_);
+        }
+
+        BlockReader(const BlockReader &) = delete;
+        BlockReader &operator=(const BlockReader &) = delete;
+
+        bool direct() const { return direct_; }
+        const char *engine() const { return ring_ != nullptr ? "io_uring" : "thread pool"; }
+
+        // Reads every request and returns once all of them have completed. Offsets, sizes and buffers have to be
+        // multiples of kSectorBytes.
+        void read(const std::vector<ReadRequest> &requests)
+        {
+            if (ring_ != nullptr)
+                read_ring(requests);
+            else
+            {
+                std::vector<std::pair<size_t, size_t>> pending(requests.size());
+                for (size_t i = 0; i < requests.size(); i++)
+                    pending[i] = {i, 0};
+                read_pool(requests, pending);
+            }
+        }
+
+    private:
+        int fd_{-1};
+        bool direct_{false};
+        size_t threads_{0};
+        std::unique_ptr<IoUring> ring_;
+        // created on first use: always without io_uring, otherwise once a ring read has to be redone
+        std::unique_ptr<scheduler::WorkStealingPool> pool_;
+
+        bool probe_direct()
+        {
+            void *buffer = std::aligned_alloc(kSectorBytes, kSectorBytes);
+            bool ok = pread(fd_, buffer, kSectorBytes, 0) >= 0;
+            free(buffer);
+            return ok;
+        }
+
+        // Finishes a request synchronously from byte `done` on.
+        void read_full(const ReadRequest &request, size_t done)
+        {
+            while (done < request.bytes)
+            {
+                ssize_t n = pread(fd_, (char *)request.buffer + done, request.bytes - done, request.offset + done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0)
+                    throw std::runtime_error("failed to read block at offset " + std::to_string(request.offset + done));
+                done += n;
+            }
+        }
+
+        // Finishes each (request, bytes already read) pair on the pread pool.
+        void read_pool(const std::vector<ReadRequest> &requests, const std::vector<std::pair<size_t, size_t>> &pending)
+        {
+            if (pending.empty())
+                return;
+            if (pool_ == nullptr)
+                pool_.reset(new scheduler::WorkStealingPool(threads_));
+            pool_->parallel_for(0, pending.size(), 1, [&](size_t lo, size_t hi)
+                                {
+                                    for (size_t i = lo; i < hi; i++)
+                                        read_full(requests[pending[i].first], pending[i].second); });
+        }
+
+        void read_ring(const std::vector<ReadRequest> &requests)
+        {
+            size_t submitted = 0, completed = 0;
+            // failed reads restart from byte 0, short reads continue where the ring stopped
+            std::vector<std::pair<size_t, size_t>> pending;
+            bool unsupported = false;
+            while (completed < requests.size())
+            {
+                unsigned batch = 0;
+                while (submitted < requests.size() && submitted - completed < ring_->entries())
+                {
+                    ring_->prepare(fd_, requests[submitted], submitted);
+                    submitted++;
+                    batch++;
+                }
+                ring_->enter(batch, 1);
+                completed += ring_->reap([&](uint64_t i, int result)
+                                         {
+                                             if (result < 0)
+                                             {
+                                                 pending.emplace_back(i, 0);
+                                                 // kernels before 5.6 reject IORING_OP_READ itself
+                                                 unsupported |= result == -EINVAL || result == -EOPNOTSUPP;
+                                             }
+                                             else if ((size_t)result < requests[i].bytes)
+                                                 pending.emplace_back(i, result); });
+            }
+            if (unsupported)
+                ring_.reset();
+            read_pool(requests, pending);
+        }
+    };
+}
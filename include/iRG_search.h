@@ -2,18 +2,60 @@
 
 #include <vector>
 #include "utils.h"
+#include "index_io.h"
 #include "searcher.hpp"
 #include "memory.hpp"
+#include <algorithm>
 #include <bitset>
+#include <cmath>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <limits>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace iRangeGraph
 {
+    // kPointMajor keeps every point's link table next to its vector and its lists in one block, sized to the
+    // distinct lists. kLayerMajor keeps each graph layer in its own contiguous array of fixed-size lists and the
+    // vectors in a matrix of their own, so a walk in one layer only touches that layer's array.
+    enum LinkLayout
+    {
+        kPointMajor = 0,
+        kLayerMajor = 1
+    };
+
+    // Cost model of the query planner, measured on vectors of dim dimensions; the distance cost that dim sets is
+    // part of every term, so a model only applies to indexes of that dim. A scan of n points for the k nearest
+    // costs scan_ns * n + scan_k_ns * k * (1 + ln(n / k)), the second term for the expected updates of the top-k
+    // heap. A graph search over range_sizes[i] points costs graph_ns[i] + graph_ef_ns[i] * max(ef, k); between
+    // the sampled sizes the cost is interpolated in the logarithm of the range size, and beyond them it is taken
+    // as that of the nearest one.
+    struct PlannerModel
+    {
+        size_t dim{0};
+        double scan_ns{0};
+        double scan_k_ns{0};
+        std::vector<long long> range_sizes;
+        std::vector<double> graph_ns;
+        std::vector<double> graph_ef_ns;
+    };
+
     template <typename dist_t>
     class iRangeGraph_Search
     {
     public:
-        DataLoader *storage;
-        SegmentTree *tree;
+        // queries, ranges and ground truth of the search() benchmark; not needed by knn() or searchBatch()
+        DataLoader *storage{nullptr};
+        std::unique_ptr<SegmentTree> tree;
         size_t max_elements_{0};
         size_t dim_{0};
         size_t M_out{0};
@@ -26,78 +68,359 @@ namespace iRangeGraph
         size_t size_links_per_layer_{0};
         size_t offsetData_{0};
 
+        // Every element starts with its link table: the offset of the point's block in links_memory_ followed by
+        // one uint16_t per graph layer locating the layer's list inside that block (in bytes). A block holds each
+        // distinct list of the point once, at its actual length; a layer whose list is identical to the layer
+        // below shares that list.
+        // Lists of a layer whose nodes span at most 2^8 (2^16) points store their size and neighbors in 8 (16)
+        // bits, the neighbors as offsets from the node's lbound; see layer_width_.
         char *data_memory_{nullptr};
+        char *links_memory_{nullptr};
+        // set when both live in a mapped search image
+        char *mapping_{nullptr};
+        size_t mapping_size_{0};
+        // set when the image is a shared segment, mapped read-only by every process
+        bool read_only_{false};
+        size_t links_bytes_{0};
+        std::vector<int> layer_width_;
+
+        // kLayerMajor: data_memory_ holds only the vectors, and the lists of layer l are layer_links_[l], one
+        // (1 + M) entry record of layer_width_[l] bytes each per point.
+        LinkLayout layout_{kPointMajor};
+        std::vector<char *> layer_links_;
+        std::vector<size_t> layer_stride_;
+
+        // the attribute values of the points, when the index was built with them; maps value ranges to positions
+        AttributeColumn attributes_;
 
-        hnswlib::L2Space *space;
+        std::unique_ptr<hnswlib::L2Space> space;
         hnswlib::DISTFUNC<dist_t> fstdistfunc_;
         void *dist_func_param_{nullptr};
 
-        size_t metric_distance_computations{0};
-        size_t metric_hops{0};
+        // searches count in their context; the counts are added here once a query or batch is done
+        std::atomic<size_t> metric_distance_computations{0};
+        std::atomic<size_t> metric_hops{0};
 
         int prefetch_lines{0};
 
-        iRangeGraph_Search(std::string vectorfilename, std::string edgefilename, DataLoader *store, int M) : storage(store)
+        // Tombstones. A deleted point is never reported, but it keeps routing searches until repairDeleted()
+        // has removed it from the lists that point to it.
+        std::unique_ptr<std::atomic<uint64_t>[]> deleted_bits_;
+        std::atomic<size_t> deleted_count_{0};
+        std::vector<int> pending_deletes_;
+        std::mutex delete_mutex_;
+        std::mutex repair_mutex_;
+        std::condition_variable repair_cv_;
+        std::thread repair_thread_;
+        bool stop_repair_{false};
+
+        // per-query scratch state, one context per concurrent query
+        std::unique_ptr<searcher::SearchContextPool> context_pool_;
+        // the threads of searchBatch, kept from batch to batch
+        std::shared_ptr<scheduler::WorkStealingPool> batch_pool_;
+        std::mutex batch_pool_mutex_;
+
+        // Query planner: a range is scanned exactly instead of searched when the scan is expected to be cheaper
+        // under planner_. Opening the index measures the model on this machine with CalibratePlanner(), so the
+        // plans of borderline ranges may differ from run to run; SetPlanner() replaces it with a model kept from
+        // planner() before, for the same plans every time. plan_ = false searches every range through the graph.
+        bool plan_{true};
+        PlannerModel planner_;
+
+        // Opens an index file or a search image written by SaveImage. M may be left 0 to take it from the file;
+        // otherwise it has to match. Images hold the point-major layout. With shared, the image (typically one
+        // published by PublishShared) is mapped read-only and shared with the other processes that map it.
+        iRangeGraph_Search(std::string indexfilename, DataLoader *store, int M = 0, bool populate = false, bool hugepages = true,
+                           LinkLayout layout = kPointMajor, bool shared = false) : storage(store), layout_(layout)
+        {
+            try
+            {
+                if (IsSearchImage(indexfilename))
+                {
+                    if (layout_ != kPointMajor)
+                        throw Exception("search images hold the point-major layout");
+                    MapImage(indexfilename, M, populate, hugepages, shared);
+                }
+                else if (shared)
+                    throw Exception(indexfilename + " is not a search image and cannot be shared");
+                else
+                    LoadIndex(indexfilename, M);
+                deleted_bits_.reset(new std::atomic<uint64_t>[(max_elements_ + 63) / 64]());
+                // a hop selects at most one list from each layer
+                context_pool_.reset(new searcher::SearchContextPool(M_out * std::max(tree->max_depth, 1), max_elements_));
+                CalibratePlanner();
+            }
+            catch (...)
+            {
+                // the destructor does not run for a failed constructor
+                ReleaseMemory();
+                throw;
+            }
+        }
+
+        // For serving: the index alone, queried through knn() or searchBatch().
+        explicit iRangeGraph_Search(std::string indexfilename, int M = 0, bool populate = false, bool hugepages = true,
+                                    LinkLayout layout = kPointMajor, bool shared = false)
+            : iRangeGraph_Search(indexfilename, nullptr, M, populate, hugepages, layout, shared) {}
+
+        void LoadIndex(std::string indexfilename, int M)
+        {
+            IndexReader reader(indexfilename);
+            CheckHeader(reader.header, M);
+            max_elements_ = reader.header.nb;
+            dim_ = reader.header.dim;
+            InitLayout(reader.header.M, reader.header.fanout, reader.header.leaf_size);
+            reader.CheckTree(*tree);
+
+            data_memory_ = (char *)memory::align_mm<1 << 21>(max_elements_ * size_data_per_element_);
+            if (data_memory_ == nullptr)
+                throw std::runtime_error("Not enough memory");
+
+            if (layout_ == kPointMajor && !LoadLinks(reader))
+            {
+                std::cout << "the lists of some points do not fit the point-major layout, loading the layer-major one" << std::endl;
+                free(data_memory_);
+                layout_ = kLayerMajor;
+                InitLayout(reader.header.M, reader.header.fanout, reader.header.leaf_size);
+                data_memory_ = (char *)memory::align_mm<1 << 21>(max_elements_ * size_data_per_element_);
+                if (data_memory_ == nullptr)
+                    throw std::runtime_error("Not enough memory");
+            }
+            if (layout_ == kLayerMajor)
+                LoadLayers(reader);
+            reader.read_vectors([this](size_t pid, const float *vector)
+                                { std::memcpy(getDataByInternalId(pid), vector, dim_ * sizeof(float)); });
+            std::vector<int64_t> keys;
+            if (reader.read_attributes(keys))
+                attributes_.assign((AttributeType)reader.header.attribute_type, std::move(keys));
+            std::cout << "load index finished ..." << std::endl;
+        }
+
+        // A search image holds data_memory_ and links_memory_ as they are searched, so nothing is parsed or copied.
+        // Pages are read as searches touch them, or all up front with populate. The mapping is private: tombstone
+        // repair modifies the process's copy, never the file. A shared mapping is read-only instead, and every
+        // process mapping the image uses the same physical pages.
+        void MapImage(std::string imagefilename, int M, bool populate, bool hugepages, bool shared = false)
+        {
+            int fd = open(imagefilename.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw Exception("cannot open " + imagefilename);
+            struct stat st;
+            fstat(fd, &st);
+            size_t file_size = st.st_size;
+            SearchImageHeader header;
+            if (file_size < sizeof(header) || pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != kImageMagic)
+            {
+                close(fd);
+                throw Exception(imagefilename + " is not an iRangeGraph search image");
+            }
+            // every region has to lie inside the file, aligned for what it holds
+            auto fits = [&](uint64_t offset, uint64_t bytes, uint64_t alignment)
+            {
+                return offset % alignment == 0 && offset <= file_size && bytes <= file_size - offset;
+            };
+            if (header.version != kImageVersion || header.nb == 0 || header.dim == 0 ||
+                !fits(header.data_offset, header.data_bytes, sizeof(uint64_t)) || !fits(header.links_offset, header.links_bytes, sizeof(int)) ||
+                !fits(header.attributes_offset, header.attributes_bytes, sizeof(int64_t)))
+            {
+                close(fd);
+                throw Exception(imagefilename + " has an unsupported version or is truncated");
+            }
+            if (M != 0 && header.M != (uint32_t)M)
+            {
+                close(fd);
+                throw Exception("index is built with M = " + std::to_string(header.M) + ", but M = " + std::to_string(M) + " is given");
+            }
+
+            int protection = shared ? PROT_READ : PROT_READ | PROT_WRITE;
+            char *mapping = (char *)mmap(nullptr, file_size, protection, (shared ? MAP_SHARED : MAP_PRIVATE) | (populate ? MAP_POPULATE : 0), fd, 0);
+            close(fd);
+            if (mapping == MAP_FAILED)
+                throw Exception("cannot map " + imagefilename);
+            // unmaps the image if a check below throws
+            struct MappingGuard
+            {
+                char *address;
+                size_t bytes;
+                ~MappingGuard()
+                {
+                    if (address != nullptr)
+                        munmap(address, bytes);
+                }
+            } guard{mapping, file_size};
+            if (hugepages)
+                madvise(mapping, file_size, MADV_HUGEPAGE);
+            if (!populate)
+                madvise(mapping, file_size, MADV_RANDOM);
+
+            max_elements_ = header.nb;
+            dim_ = header.dim;
+            InitLayout(header.M, header.fanout, header.leaf_size);
+            if (header.size_data_per_element != size_data_per_element_ || header.data_bytes != max_elements_ * size_data_per_element_)
+                throw Exception(imagefilename + " was written with a different element layout");
+            if (tree->max_depth > 0 && header.links_bytes == 0)
+                throw Exception(imagefilename + " holds no lists");
+            if (header.attribute_type != kAttributeNone && header.attributes_bytes != max_elements_ * sizeof(int64_t))
+                throw Exception(imagefilename + " has an invalid attribute column");
+
+            mapping_ = mapping;
+            mapping_size_ = file_size;
+            read_only_ = shared;
+            guard.address = nullptr;
+            data_memory_ = mapping_ + header.data_offset;
+            links_memory_ = mapping_ + header.links_offset;
+            links_bytes_ = header.links_bytes;
+            if (header.attribute_type != kAttributeNone)
+                attributes_.view((AttributeType)header.attribute_type, (const int64_t *)(mapping_ + header.attributes_offset), max_elements_);
+            std::cout << "map index finished ..." << std::endl;
+        }
+
+        ~iRangeGraph_Search()
         {
-            std::ifstream vectorfile(vectorfilename, std::ios::in | std::ios::binary);
-            if (!vectorfile.is_open())
-                throw Exception("cannot open " + vectorfilename);
-            std::ifstream edgefile(edgefilename, std::ios::in | std::ios::binary);
-            if (!edgefile.is_open())
-                throw Exception("cannot open " + edgefilename);
+            stopBackgroundRepair();
+            ReleaseMemory();
+        }
 
-            vectorfile.read((char *)&max_elements_, sizeof(int));
-            vectorfile.read((char *)&dim_, sizeof(int));
+        void ReleaseMemory()
+        {
+            if (mapping_ != nullptr)
+                munmap(mapping_, mapping_size_);
+            else
+            {
+                free(data_memory_);
+                free(links_memory_);
+            }
+            for (auto links : layer_links_)
+                free(links);
+            layer_links_.clear();
+            mapping_ = nullptr;
+            data_memory_ = nullptr;
+            links_memory_ = nullptr;
+        }
 
-            tree = new SegmentTree(max_elements_);
-            tree->BuildTree(tree->root);
+        void InitLayout(int M, int fanout, int leaf_size)
+        {
+            tree.reset(new SegmentTree(max_elements_, fanout, leaf_size));
 
-            space = new hnswlib::L2Space(dim_);
+            space.reset(new hnswlib::L2Space(dim_));
             fstdistfunc_ = space->get_dist_func();
             dist_func_param_ = space->get_dist_func_param();
             M_out = M;
 
             data_size_ = (dim_ + 7) / 8 * 8 * sizeof(float);
             size_links_per_layer_ = M_out * sizeof(tableint) + sizeof(linklistsizeint);
-            size_links_per_element_ = (size_links_per_layer_ * (tree->max_depth + 1) + 31) / 32 * 32;
+            // the leaves (layer max_depth) have no graph and get no link table entry
+            size_links_per_element_ = 0;
+            if (layout_ == kPointMajor)
+                size_links_per_element_ = (sizeof(uint64_t) + sizeof(uint16_t) * tree->max_depth + 31) / 32 * 32;
             size_data_per_element_ = size_links_per_element_ + data_size_;
             offsetData_ = size_links_per_element_;
             prefetch_lines = data_size_ >> 4;
 
-            data_memory_ = (char *)memory::align_mm<1 << 21>(max_elements_ * size_data_per_element_);
-            if (data_memory_ == nullptr)
-                throw std::runtime_error("Not enough memory");
+            layer_width_.resize(tree->max_depth);
+            for (int layer = 0; layer < tree->max_depth; layer++)
+                layer_width_[layer] = ListWidth(tree->node_span(layer));
+        }
 
-            for (int pid = 0; pid < max_elements_; pid++)
+        // Bytes per list entry at a layer whose nodes span this many points.
+        static int ListWidth(long long span)
+        {
+            return span <= (1 << 8) ? 1 : span <= (1 << 16) ? 2 : 4;
+        }
+
+        // Writes the loaded index as an image for the mapping constructor. data_memory_ and links_memory_ start on
+        // 2 MB boundaries of the file so that they can be backed by huge pages.
+        void SaveImage(std::string imagefilename)
+        {
+            SearchImageHeader header = ImageHeader();
+            CheckPath(imagefilename);
+            std::ofstream imagefile(imagefilename, std::ios::out | std::ios::binary);
+            if (!imagefile.is_open())
+                throw Exception("cannot open " + imagefilename);
+            std::vector<char> padding(kImageAlignment, 0);
+            imagefile.write((char *)&header, sizeof(header));
+            imagefile.write(padding.data(), header.data_offset - sizeof(header));
+            imagefile.write(data_memory_, header.data_bytes);
+            imagefile.write(padding.data(), header.links_offset - header.data_offset - header.data_bytes);
+            imagefile.write(links_memory_, header.links_bytes);
+            if (header.attributes_bytes > 0)
             {
-                for (int layer = 0; layer <= tree->max_depth; layer++)
-                {
-                    linklistsizeint *data = get_linklist(pid, layer);
-                    edgefile.read((char *)data, sizeof(tableint));
-                    int size = getListCount(data);
-                    if (size > M_out)
-                        throw Exception("real linklist size is bigger than defined M_out");
-                    for (int i = 0; i < size; i++)
-                    {
-                        char *current_neighbor_ = (char *)(data + 1 + i);
-                        edgefile.read(current_neighbor_, sizeof(tableint));
-                    }
-                }
+                imagefile.write(padding.data(), header.attributes_offset - header.links_offset - header.links_bytes);
+                imagefile.write((const char *)attributes_.data(), header.attributes_bytes);
+            }
+            imagefile.close();
+            if (imagefile.fail())
+                throw Exception("failed to write " + imagefilename);
+        }
 
-                char *data = getDataByInternalId(pid);
-                // vectorfile.read(data, data_size_);
-                vectorfile.read(data, dim_ * sizeof(float));
+        SearchImageHeader ImageHeader() const
+        {
+            if (layout_ != kPointMajor)
+                throw Exception("search images hold the point-major layout");
+            SearchImageHeader header;
+            header.nb = max_elements_;
+            header.dim = dim_;
+            header.M = M_out;
+            header.fanout = tree->ways_;
+            header.leaf_size = tree->leaf_size_;
+            header.size_data_per_element = size_data_per_element_;
+            header.data_offset = kImageAlignment;
+            header.data_bytes = max_elements_ * size_data_per_element_;
+            header.links_offset = (header.data_offset + header.data_bytes + kImageAlignment - 1) / kImageAlignment * kImageAlignment;
+            header.links_bytes = links_bytes_;
+            if (!attributes_.empty())
+            {
+                header.attribute_type = attributes_.type();
+                header.attributes_offset = (header.links_offset + header.links_bytes + 63) / 64 * 64;
+                header.attributes_bytes = attributes_.size() * sizeof(int64_t);
             }
+            return header;
+        }
 
-            edgefile.close();
-            vectorfile.close();
-            std::cout << "load index finished ..." << std::endl;
+        // Publishes the loaded index as a search image in shared memory (/dev/shm/<name>) or, given a path, in a
+        // file on a hugetlbfs mount. The image is written through a shared mapping, which hugetlbfs requires, to
+        // a temporary name and renamed into place, so processes attaching never see a partial image.
+        void PublishShared(std::string name)
+        {
+            std::string path = SharedImagePath(name);
+            std::string temppath = path + ".tmp";
+            SearchImageHeader header = ImageHeader();
+            size_t end = std::max(header.links_offset + header.links_bytes, header.attributes_offset + header.attributes_bytes);
+            size_t bytes = (end + kImageAlignment - 1) / kImageAlignment * kImageAlignment;
+
+            int fd = open(temppath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                throw Exception("cannot open " + temppath);
+            if (ftruncate(fd, bytes) != 0)
+            {
+                close(fd);
+                unlink(temppath.c_str());
+                throw Exception("cannot allocate " + std::to_string(bytes) + " bytes for " + temppath);
+            }
+            char *segment = (char *)mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            close(fd);
+            if (segment == MAP_FAILED)
+            {
+                unlink(temppath.c_str());
+                throw Exception("cannot map " + temppath);
+            }
+            std::memcpy(segment, &header, sizeof(header));
+            std::memcpy(segment + header.data_offset, data_memory_, header.data_bytes);
+            std::memcpy(segment + header.links_offset, links_memory_, header.links_bytes);
+            if (header.attributes_bytes > 0)
+                std::memcpy(segment + header.attributes_offset, attributes_.data(), header.attributes_bytes);
+            munmap(segment, bytes);
+            if (rename(temppath.c_str(), path.c_str()) != 0)
+            {
+                unlink(temppath.c_str());
+                throw Exception("cannot publish " + path);
+            }
         }
 
-        ~iRangeGraph_Search()
+        void CheckHeader(const IndexHeader &header, int M)
         {
-            free(data_memory_);
-            data_memory_ = nullptr;
+            if (M != 0 && header.M != (uint32_t)M)
+                throw Exception("index is built with M = " + std::to_string(header.M) + ", but M = " + std::to_string(M) + " is given");
         }
 
         inline char *getDataByInternalId(tableint internal_id) const
@@ -105,9 +428,185 @@ namespace iRangeGraph
             return (data_memory_ + internal_id * size_data_per_element_ + offsetData_);
         }
 
+        inline uint64_t &link_block(tableint internal_id) const
+        {
+            return *(uint64_t *)(data_memory_ + internal_id * size_data_per_element_);
+        }
+
+        inline uint16_t *link_offsets(tableint internal_id) const
+        {
+            return (uint16_t *)(data_memory_ + internal_id * size_data_per_element_ + sizeof(uint64_t));
+        }
+
         linklistsizeint *get_linklist(tableint internal_id, int layer) const
         {
-            return (linklistsizeint *)(data_memory_ + internal_id * size_data_per_element_ + layer * size_links_per_layer_);
+            if (layout_ == kLayerMajor)
+                return (linklistsizeint *)(layer_links_[layer] + internal_id * layer_stride_[layer]);
+            return (linklistsizeint *)(links_memory_ + link_block(internal_id) + link_offsets(internal_id)[layer]);
+        }
+
+        // Entry j of a list stored with the given width: j = 0 is the list size, j >= 1 the neighbors, which narrow
+        // lists store as offsets from base, the lbound of the point's node at that layer. Entries are accessed
+        // atomically, as repair rewrites lists while searches read them.
+        static inline int ListEntry(const void *list, int width, int base, int j)
+        {
+            if (width == 1)
+                return j == 0 ? LoadEntry((const uint8_t *)list, 0) : base + LoadEntry((const uint8_t *)list, j);
+            if (width == 2)
+                return j == 0 ? LoadEntry((const uint16_t *)list, 0) : base + LoadEntry((const uint16_t *)list, j);
+            return LoadEntry((const int *)list, j);
+        }
+
+        static inline void SetListEntry(void *list, int width, int base, int j, int value)
+        {
+            if (width == 4)
+            {
+                __atomic_store_n((int *)list + j, value, __ATOMIC_RELAXED);
+                return;
+            }
+            if (j > 0)
+                value -= base;
+            if (width == 1)
+                __atomic_store_n((uint8_t *)list + j, (uint8_t)value, __ATOMIC_RELAXED);
+            else
+                __atomic_store_n((uint16_t *)list + j, (uint16_t)value, __ATOMIC_RELAXED);
+        }
+
+        // a relaxed load is a plain load on x86 and ARM, so searches pay nothing for it
+        template <typename id_t>
+        static inline id_t LoadEntry(const id_t *list, int j) { return __atomic_load_n(list + j, __ATOMIC_RELAXED); }
+
+        int ListBase(int pid, int layer) const
+        {
+            long long span = tree->node_span(layer);
+            return layer_width_[layer] == 4 ? 0 : pid / span * span;
+        }
+
+        // Streams the graph layers twice, deepest first, without holding a layer in memory. The first pass lays out
+        // the block of every point: a list is shared with the layer below when its width, its base and a fingerprint
+        // of its entries are the same. The second pass encodes the distinct lists and checks every shared one against
+        // the list it shares, which is encoded by then, so fingerprints that collide cannot go unnoticed.
+        // Returns false, leaving nothing allocated, when the distinct lists of a point take more than the 64 KB its
+        // 16-bit offsets reach, or when two of its lists cannot be told apart by their fingerprints; the caller
+        // then loads the layer-major layout.
+        bool LoadLinks(IndexReader &reader)
+        {
+            int layer_num = tree->max_depth;
+            // a missing section holds empty lists
+            std::vector<int> empty(M_out + 1, 0);
+            auto visit_layer = [&](int layer, std::function<void(size_t, const int *)> visitor)
+            {
+                if (reader.read_layer(layer, visitor))
+                    return;
+                scheduler::parallel_chunks(0, max_elements_, reader.threads, [&](size_t lo, size_t hi)
+                                           {
+                    for (size_t pid = lo; pid < hi; pid++)
+                        visitor(pid, empty.data()); });
+            };
+            auto fingerprint = [](const int *list)
+            {
+                uint64_t hash = 0xcbf29ce484222325ull;
+                for (int j = 0; j <= list[0]; j++)
+                    hash = (hash ^ (uint32_t)list[j]) * 0x100000001b3ull;
+                return hash;
+            };
+
+            // both passes only touch per-point state, so the reader's threads visit points concurrently
+            std::vector<uint64_t> fingerprints(max_elements_, 0);
+            std::vector<uint32_t> block_bytes(max_elements_, 0);
+            std::atomic<bool> overflow{false};
+            for (int layer = layer_num - 1; layer >= 0; layer--)
+            {
+                int width = layer_width_[layer];
+                bool same_width = layer + 1 < layer_num && width == layer_width_[layer + 1];
+                visit_layer(layer, [&](size_t pid, const int *list)
+                            {
+                    uint16_t *offsets = link_offsets(pid);
+                    uint64_t hash = fingerprint(list);
+                    bool shared = same_width && hash == fingerprints[pid] && ListBase(pid, layer) == ListBase(pid, layer + 1);
+                    fingerprints[pid] = hash;
+                    if (shared)
+                    {
+                        offsets[layer] = offsets[layer + 1];
+                        return;
+                    }
+                    uint32_t offset = (block_bytes[pid] + width - 1) / width * width;
+                    if (offset > std::numeric_limits<uint16_t>::max())
+                        overflow = true;
+                    offsets[layer] = offset;
+                    block_bytes[pid] = offset + (list[0] + 1) * width; });
+                if (overflow)
+                    return false;
+            }
+            std::vector<uint64_t>().swap(fingerprints);
+
+            links_bytes_ = 0;
+            for (size_t pid = 0; pid < max_elements_; pid++)
+            {
+                link_block(pid) = links_bytes_;
+                links_bytes_ += (block_bytes[pid] + 3) / 4 * 4;
+            }
+            links_memory_ = (char *)memory::align_mm<1 << 21>(std::max<size_t>(links_bytes_, 1));
+
+            std::atomic<bool> collision{false};
+            for (int layer = layer_num - 1; layer >= 0; layer--)
+            {
+                int width = layer_width_[layer];
+                visit_layer(layer, [&](size_t pid, const int *list)
+                            {
+                    uint16_t *offsets = link_offsets(pid);
+                    void *dst = get_linklist(pid, layer);
+                    int base = ListBase(pid, layer);
+                    if (layer + 1 < layer_num && offsets[layer] == offsets[layer + 1])
+                    {
+                        for (int j = 0; j <= list[0]; j++)
+                        {
+                            if (ListEntry(dst, width, base, j) != list[j])
+                                collision = true;
+                        }
+                        return;
+                    }
+                    for (int j = 0; j <= list[0]; j++)
+                        SetListEntry(dst, width, base, j, list[j]); });
+            }
+            if (collision)
+            {
+                free(links_memory_);
+                links_memory_ = nullptr;
+                links_bytes_ = 0;
+                return false;
+            }
+            std::cout << "link memory: " << (links_bytes_ + max_elements_ * size_links_per_element_) / (1 << 20) << " MB, "
+                      << "fixed-size lists would take " << max_elements_ * layer_num * size_links_per_layer_ / (1 << 20) << " MB" << std::endl;
+            return true;
+        }
+
+        // Reads every graph layer straight into its own array. Each array is advised onto huge pages, and
+        // can be placed independently of the others.
+        void LoadLayers(IndexReader &reader)
+        {
+            int layer_num = tree->max_depth;
+            layer_links_.assign(layer_num, nullptr);
+            layer_stride_.assign(layer_num, 0);
+            size_t total_bytes = 0;
+            for (int layer = 0; layer < layer_num; layer++)
+            {
+                int width = layer_width_[layer];
+                layer_stride_[layer] = (M_out + 1) * width;
+                size_t bytes = (max_elements_ * layer_stride_[layer] + (1 << 21) - 1) >> 21 << 21;
+                layer_links_[layer] = (char *)memory::align_mm<1 << 21>(bytes);
+                if (layer_links_[layer] == nullptr)
+                    throw std::runtime_error("Not enough memory");
+                madvise(layer_links_[layer], bytes, MADV_HUGEPAGE);
+                total_bytes += bytes;
+                reader.read_layer(layer, [&](size_t pid, const int *record)
+                                  {
+                                      void *dst = get_linklist(pid, layer);
+                                      int base = ListBase(pid, layer);
+                                      for (int j = 0; j <= record[0]; j++)
+                                          SetListEntry(dst, width, base, j, record[j]); });
+            }
+            std::cout << "link memory: " << total_bytes / (1 << 20) << " MB in " << layer_num << " layer arrays" << std::endl;
         }
 
         int getListCount(linklistsizeint *ptr) const
@@ -122,96 +621,574 @@ namespace iRangeGraph
             return R - L + 1;
         }
 
-        std::vector<tableint> SelectEdge(int pid, int ql, int qr, int edge_limit, searcher::Bitset<uint64_t> &visited_set)
+        inline bool isDeleted(int pid) const
+        {
+            return (deleted_bits_[pid >> 6].load(std::memory_order_relaxed) >> (pid & 63)) & 1;
+        }
+
+        // Safe to call while other threads search; the point disappears from results immediately.
+        void markDeleted(int pid)
+        {
+            if (pid < 0 || pid >= (int)max_elements_)
+                throw Exception("point id out of range");
+            uint64_t bit = uint64_t(1) << (pid & 63);
+            if (deleted_bits_[pid >> 6].fetch_or(bit) & bit)
+                return;
+            deleted_count_++;
+            {
+                std::lock_guard<std::mutex> lock(delete_mutex_);
+                pending_deletes_.emplace_back(pid);
+            }
+            repair_cv_.notify_one();
+        }
+
+        // Replaces the deleted neighbors of pid at this layer by the live neighbors they had there, which lie in the
+        // same tree node, and re-prunes the list. The list is rewritten in place with its size stored last, so a
+        // concurrent reader sees either list or a mix of both, and every slot always holds a valid id of the node.
+        // Lists are stored at their actual length, so the repaired list is no longer than the old one.
+        // A list shared with the layer below is repaired there only, with neighbors inside the smaller node, which
+        // are valid for both layers; rewriting it here would put neighbors outside that node into the lower layer.
+        bool repair_list(int pid, int layer)
         {
-            TreeNode *cur_node = nullptr, *nxt_node = tree->root;
-            std::vector<tableint> selected_edges;
-            selected_edges.reserve(edge_limit);
-            do
+            if (isDeleted(pid))
+                return false;
+            if (layer + 1 < tree->max_depth && get_linklist(pid, layer) == get_linklist(pid, layer + 1))
+                return false;
+            int width = layer_width_[layer];
+            int base = ListBase(pid, layer);
+            void *data = get_linklist(pid, layer);
+            int size = ListEntry(data, width, base, 0);
+            bool affected = false;
+            for (int j = 1; j <= size && !affected; j++)
+                affected = isDeleted(ListEntry(data, width, base, j));
+            if (!affected)
+                return false;
+
+            std::vector<int> candidate_ids;
+            for (int j = 1; j <= size; j++)
             {
-                cur_node = nxt_node;
-                bool contain = false;
-                do
+                int neighborId = ListEntry(data, width, base, j);
+                if (!isDeleted(neighborId))
                 {
-                    contain = false;
-                    if (cur_node->childs.size() == 0)
-                        nxt_node = nullptr;
-                    else
+                    candidate_ids.emplace_back(neighborId);
+                    continue;
+                }
+                void *nb_data = get_linklist(neighborId, layer);
+                int nb_size = ListEntry(nb_data, width, base, 0);
+                for (int k = 1; k <= nb_size; k++)
+                {
+                    int id = ListEntry(nb_data, width, base, k);
+                    if (id != pid && !isDeleted(id))
+                        candidate_ids.emplace_back(id);
+                }
+            }
+            std::sort(candidate_ids.begin(), candidate_ids.end());
+            candidate_ids.erase(std::unique(candidate_ids.begin(), candidate_ids.end()), candidate_ids.end());
+
+            std::vector<PFI> candidates;
+            char *pid_data = getDataByInternalId(pid);
+            for (auto id : candidate_ids)
+                candidates.emplace_back(fstdistfunc_(pid_data, getDataByInternalId(id), dist_func_param_), id);
+            std::sort(candidates.begin(), candidates.end());
+
+            std::vector<int> selected;
+            for (auto &candidate : candidates)
+            {
+                if (selected.size() >= (size_t)size)
+                    break;
+                bool good = true;
+                char *candidate_data = getDataByInternalId(candidate.second);
+                for (auto id : selected)
+                {
+                    if (fstdistfunc_(candidate_data, getDataByInternalId(id), dist_func_param_) < candidate.first)
                     {
-                        for (int i = 0; i < cur_node->childs.size(); ++i)
-                        {
-                            if (cur_node->childs[i]->lbound <= pid && cur_node->childs[i]->rbound >= pid)
-                            {
-                                nxt_node = cur_node->childs[i];
-                                break;
-                            }
-                        }
-                        if (GetOverLap(cur_node->lbound, cur_node->rbound, ql, qr) == GetOverLap(nxt_node->lbound, nxt_node->rbound, ql, qr))
-                        {
-                            cur_node = nxt_node;
-                            contain = true;
-                        }
+                        good = false;
+                        break;
                     }
-                } while (contain);
+                }
+                if (good)
+                    selected.emplace_back(candidate.second);
+            }
 
-                int *data = (int *)get_linklist(pid, cur_node->depth);
-                size_t size = getListCount((linklistsizeint *)data);
+            for (size_t j = 0; j < selected.size(); j++)
+                SetListEntry(data, width, base, j + 1, selected[j]);
+            std::atomic_thread_fence(std::memory_order_release);
+            SetListEntry(data, width, base, 0, selected.size());
+            return true;
+        }
+
+        // Repairs the lists affected by the deletes made since the last repair, layer by layer. Lists at a layer
+        // only point inside their tree node, so only the nodes that contain a deleted point are scanned.
+        // Returns the number of lists rewritten. Safe to run while other threads search.
+        size_t repairDeleted()
+        {
+            if (read_only_)
+                throw Exception("a shared index is read-only; deleted points cannot be repaired");
+            std::lock_guard<std::mutex> repair_lock(repair_mutex_);
+            std::vector<int> batch;
+            {
+                std::lock_guard<std::mutex> lock(delete_mutex_);
+                batch.swap(pending_deletes_);
+            }
+            if (batch.empty())
+                return 0;
+            std::sort(batch.begin(), batch.end());
 
-                for (size_t j = 1; j <= size; ++j)
+            size_t repaired = 0;
+            for (int layer = tree->max_depth - 1; layer >= 0; layer--)
+            {
+                long long span = tree->node_span(layer);
+                long long last_lbound = -1;
+                for (auto pid : batch)
                 {
-                    int neighborId = *(data + j);
-                    if (neighborId < ql || neighborId > qr)
-                        continue;
-                    // if (visitedpool[neighborId] == visited_tag)
-                    //     continue;
-                    if (visited_set.get(neighborId))
+                    long long lbound = pid / span * span;
+                    if (lbound == last_lbound)
                         continue;
-                    selected_edges.emplace_back(neighborId);
-                    if (selected_edges.size() == edge_limit)
-                        return selected_edges;
+                    last_lbound = lbound;
+                    long long rbound = std::min<long long>(lbound + span, max_elements_) - 1;
+                    for (long long p = lbound; p <= rbound; p++)
+                        repaired += repair_list(p, layer);
+                }
+            }
+            return repaired;
+        }
+
+        // Runs repairDeleted() on a background thread whenever new deletes arrive.
+        void startBackgroundRepair()
+        {
+            if (read_only_)
+                throw Exception("a shared index is read-only; deleted points cannot be repaired");
+            if (repair_thread_.joinable())
+                return;
+            stop_repair_ = false;
+            repair_thread_ = std::thread([this]
+                                         {
+                                             while (true)
+                                             {
+                                                 {
+                                                     std::unique_lock<std::mutex> lock(delete_mutex_);
+                                                     repair_cv_.wait(lock, [this]
+                                                                     { return stop_repair_ || !pending_deletes_.empty(); });
+                                                     if (stop_repair_)
+                                                         return;
+                                                 }
+                                                 repairDeleted();
+                                             } });
+        }
+
+        void stopBackgroundRepair()
+        {
+            if (!repair_thread_.joinable())
+                return;
+            {
+                std::lock_guard<std::mutex> lock(delete_mutex_);
+                stop_repair_ = true;
+            }
+            repair_cv_.notify_one();
+            repair_thread_.join();
+        }
+
+        // Appends the unvisited neighbors within [ql, qr] of a list stored as id_t to ctx.edges; returns true once
+        // edge_limit live neighbors are selected.
+        template <typename id_t>
+        bool CollectEdges(const id_t *data, int base, int ql, int qr, int edge_limit, searcher::SearchContext &ctx,
+                          int &num_edges, int &routing_only)
+        {
+            size_t size = LoadEntry(data, 0);
+            for (size_t j = 1; j <= size; ++j)
+            {
+                int neighborId = base + LoadEntry(data, j);
+                if (neighborId < ql || neighborId > qr)
+                    continue;
+                if (ctx.is_visited(neighborId))
+                    continue;
+                ctx.edges[num_edges++] = neighborId;
+                // deleted neighbors are still followed but do not use up the edge budget
+                if (isDeleted(neighborId))
+                    ++routing_only;
+                if (num_edges - routing_only == edge_limit)
+                    return true;
+            }
+            return false;
+        }
+
+        // Selects the neighbors of pid to expand into ctx.edges and returns their number. top_depth is
+        // tree->lca_depth(ql, qr), the same for every hop of a query.
+        int SelectEdge(int pid, int ql, int qr, int edge_limit, searcher::SearchContext &ctx, int top_depth)
+        {
+            int num_edges = 0, routing_only = 0;
+            tree->for_each_split_layer(pid, ql, qr, top_depth, [&](int depth, int lbound)
+                                       {
+                void *data = get_linklist(pid, depth);
+                switch (layer_width_[depth])
+                {
+                case 1:
+                    return CollectEdges((const uint8_t *)data, lbound, ql, qr, edge_limit, ctx, num_edges, routing_only);
+                case 2:
+                    return CollectEdges((const uint16_t *)data, lbound, ql, qr, edge_limit, ctx, num_edges, routing_only);
+                default:
+                    return CollectEdges((const int *)data, 0, ql, qr, edge_limit, ctx, num_edges, routing_only);
+                } });
+            return num_edges;
+        }
+
+        // Exact search over [l, r], which is stored contiguously, into the max-heap ctx.top.
+        void ScanRange(searcher::SearchContext &ctx, int l, int r, const void *query_data, int query_k)
+        {
+            std::vector<PFI> &top_candidates = ctx.top;
+            for (int pid = l; pid <= r; pid++)
+            {
+                if (pid + 1 <= r)
+                    memory::mem_prefetch_L1(getDataByInternalId(pid + 1), this->prefetch_lines);
+                if (isDeleted(pid))
+                    continue;
+                float dis = fstdistfunc_(query_data, getDataByInternalId(pid), dist_func_param_);
+                if (top_candidates.size() < (size_t)query_k)
+                {
+                    top_candidates.emplace_back(dis, pid);
+                    std::push_heap(top_candidates.begin(), top_candidates.end());
+                }
+                else if (dis < top_candidates.front().first)
+                {
+                    std::pop_heap(top_candidates.begin(), top_candidates.end());
+                    top_candidates.back() = PFI(dis, pid);
+                    std::push_heap(top_candidates.begin(), top_candidates.end());
+                }
+            }
+            ctx.distance_computations += r - l + 1;
+        }
+
+        std::priority_queue<PFI> TopDown_nodeentries_search(const TreeNode *filterednodes, int filtered_num, const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit)
+        {
+            searcher::SearchContext *ctx = context_pool_->get();
+            TopDown_nodeentries_search(*ctx, filterednodes, filtered_num, query_data, ef, query_k, QL, QR, edge_limit);
+            std::priority_queue<PFI> res(ctx->top.begin(), ctx->top.end());
+            MergeMetrics(*ctx);
+            context_pool_->release(ctx);
+            return res;
+        }
+
+        // Returns the k nearest points to q among the points ql..qr (positions in attribute order) as (id, distance),
+        // nearest first. Safe to call from any number of threads; allocates nothing but the result once every
+        // thread has served a query as wide with as large an ef.
+        std::vector<std::pair<int, float>> knn(const float *q, int ql, int qr, int k, int ef)
+        {
+            if (ql < 0 || qr >= (int)max_elements_ || ql > qr)
+                throw Exception("query range out of bounds");
+            thread_local std::vector<TreeNode> filterednodes;
+            if (filterednodes.size() < (size_t)tree->max_filtered_nodes())
+                filterednodes.resize(tree->max_filtered_nodes());
+            searcher::SearchContext *ctx = context_pool_->get();
+            int filtered_num = tree->range_filter(ql, qr, filterednodes.data());
+            TopDown_nodeentries_search(*ctx, filterednodes.data(), filtered_num, q, std::max(ef, k), k, ql, qr, M_out);
+            std::sort(ctx->top.begin(), ctx->top.end());
+            std::vector<std::pair<int, float>> res;
+            res.reserve(ctx->top.size());
+            for (auto &candidate : ctx->top)
+                res.emplace_back(candidate.second, candidate.first);
+            MergeMetrics(*ctx);
+            context_pool_->release(ctx);
+            return res;
+        }
+
+        // The same over the points whose attribute value lies between lo and hi, for an index built with attribute
+        // values, e.g. knn(q, AttributeBound::Inclusive(from), AttributeBound::Exclusive(to), k, ef).
+        std::vector<std::pair<int, float>> knn(const float *q, const AttributeBound &lo, const AttributeBound &hi, int k, int ef)
+        {
+            std::pair<int, int> ranks = attributes_.ranks(lo, hi);
+            if (ranks.first > ranks.second)
+                return {};
+            return knn(q, ranks.first, ranks.second, k, ef);
+        }
+
+        void MergeMetrics(searcher::SearchContext &ctx)
+        {
+            metric_distance_computations += ctx.distance_computations;
+            metric_hops += ctx.hops;
+            ctx.distance_computations = ctx.hops = 0;
+        }
+
+        // Answers queries[i] over ranges[i] on up to `threads` threads and returns the k nearest points of each
+        // query as (distance, id), nearest first. The threads are kept for the next batch; a batch asking for a
+        // different number of threads replaces them once the batches using them are done.
+        std::vector<std::vector<PFI>> searchBatch(const std::vector<std::vector<float>> &queries, const std::vector<std::pair<int, int>> &ranges,
+                                                  int k, int ef, int threads)
+        {
+            std::shared_ptr<scheduler::WorkStealingPool> pool;
+            if (threads > 1 && queries.size() > 1)
+            {
+                std::lock_guard<std::mutex> lock(batch_pool_mutex_);
+                if (batch_pool_ == nullptr || batch_pool_->size() != (size_t)threads)
+                    batch_pool_ = std::make_shared<scheduler::WorkStealingPool>(threads);
+                pool = batch_pool_;
+            }
+            return searchBatch(queries, ranges, k, ef, pool.get());
+        }
+
+        // The same on the caller's pool, or on the calling thread alone when pool is null. Every worker searches
+        // with a context of its own, and their counts are added to the metrics once the batch is done, so batches
+        // may run concurrently with other searches, on the same pool or not.
+        std::vector<std::vector<PFI>> searchBatch(const std::vector<std::vector<float>> &queries, const std::vector<std::pair<int, int>> &ranges,
+                                                  int k, int ef, scheduler::WorkStealingPool *pool)
+        {
+            if (queries.size() != ranges.size())
+                throw Exception("searchBatch needs one range per query");
+            for (auto &query : queries)
+            {
+                if (query.size() != dim_)
+                    throw Exception("query has " + std::to_string(query.size()) + " dimensions, the index has " + std::to_string(dim_));
+            }
+            for (auto &range : ranges)
+            {
+                if (range.first < 0 || range.second >= (int)max_elements_ || range.first > range.second)
+                    throw Exception("query range out of bounds");
+            }
+            std::vector<std::vector<PFI>> results(queries.size());
+
+            // one slot per pool worker; threads from outside the pool (this caller, or the caller of another batch
+            // waiting on the same pool) take a context for the chunk they run
+            struct WorkerState
+            {
+                searcher::SearchContext *ctx{nullptr};
+                std::vector<TreeNode> filterednodes;
+            };
+            std::vector<WorkerState> workers(pool == nullptr ? 0 : pool->size());
+            auto run = [&](size_t lo, size_t hi)
+            {
+                int worker = pool == nullptr ? -1 : pool->worker_index();
+                WorkerState outside;
+                WorkerState &state = worker < 0 ? outside : workers[worker];
+                if (state.ctx == nullptr)
+                {
+                    state.ctx = context_pool_->get();
+                    state.filterednodes.resize(tree->max_filtered_nodes());
                 }
+                for (size_t i = lo; i < hi; i++)
+                {
+                    int ql = ranges[i].first, qr = ranges[i].second;
+                    int filtered_num = tree->range_filter(ql, qr, state.filterednodes.data());
+                    TopDown_nodeentries_search(*state.ctx, state.filterednodes.data(), filtered_num, queries[i].data(), std::max(ef, k), k, ql, qr, M_out);
+                    results[i] = state.ctx->top;
+                    std::sort(results[i].begin(), results[i].end());
+                }
+                if (worker < 0)
+                {
+                    MergeMetrics(*outside.ctx);
+                    context_pool_->release(outside.ctx);
+                }
+            };
+            // small grains keep the threads busy when query costs differ a lot between ranges
+            if (pool == nullptr)
+                run(0, queries.size());
+            else
+                pool->parallel_for(0, queries.size(), 16, run);
 
-            } while (cur_node->lbound < ql || cur_node->rbound > qr);
+            for (auto &state : workers)
+            {
+                if (state.ctx == nullptr)
+                    continue;
+                MergeMetrics(*state.ctx);
+                context_pool_->release(state.ctx);
+            }
+            return results;
+        }
 
-            return selected_edges;
+        // Leaves the query_k nearest points in ctx.top. Allocates nothing once ctx has served a query as wide as
+        // [QL, QR] with as large an ef. With use_heap, ctx.heap is searched instead of ctx.pool.
+        void TopDown_nodeentries_search(searcher::SearchContext &ctx, const TreeNode *filterednodes, int filtered_num, const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit, bool use_heap = false)
+        {
+            ctx.begin(QL, QR);
+            // a range inside a single leaf has no graph to search
+            long long leaf_span = tree->node_span(tree->max_depth);
+            if (QL / leaf_span == QR / leaf_span || PlanScan(QR - QL + 1, ef, query_k))
+            {
+                ScanRange(ctx, QL, QR, query_data, query_k);
+                return;
+            }
+            if (use_heap)
+            {
+                ctx.heap.reset(ef);
+                GraphSearch(ctx, ctx.heap, filterednodes, filtered_num, query_data, QL, QR, edge_limit);
+                ctx.heap.results(query_k, ctx.top);
+            }
+            else
+            {
+                // deleted points take pool slots without counting towards ef, hence the room for as many again
+                ctx.pool.reset(ef, 2 * ef);
+                GraphSearch(ctx, ctx.pool, filterednodes, filtered_num, query_data, QL, QR, edge_limit);
+                ctx.pool.results(query_k, ctx.top);
+            }
         }
 
-        std::priority_queue<PFI> TopDown_nodeentries_search(std::vector<TreeNode *> &filterednodes, const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit)
+        bool PlanScan(long long range_size, int ef, int k) const
+        {
+            if (!plan_ || planner_.range_sizes.empty())
+                return false;
+            return ScanCost(range_size, k) < GraphCost(range_size, std::max(ef, k));
+        }
+
+        double ScanCost(long long range_size, int k) const
+        {
+            return planner_.scan_ns * range_size + planner_.scan_k_ns * HeapUpdates(range_size, k);
+        }
+
+        // Expected updates of a top-k heap over n points in random order of distance.
+        static double HeapUpdates(long long n, int k)
+        {
+            return n <= k ? n : k * (1 + std::log((double)n / k));
+        }
+
+        double GraphCost(long long range_size, int ef) const
+        {
+            const auto &sizes = planner_.range_sizes;
+            auto cost = [&](size_t i)
+            { return planner_.graph_ns[i] + planner_.graph_ef_ns[i] * ef; };
+            if (range_size <= sizes.front())
+                return cost(0);
+            if (range_size >= sizes.back())
+                return cost(sizes.size() - 1);
+            size_t i = std::upper_bound(sizes.begin(), sizes.end(), range_size) - sizes.begin();
+            double t = std::log((double)range_size / sizes[i - 1]) / std::log((double)sizes[i] / sizes[i - 1]);
+            return (1 - t) * cost(i - 1) + t * cost(i);
+        }
+
+        const PlannerModel &planner() const { return planner_; }
+
+        void SetPlanner(const PlannerModel &model)
+        {
+            size_t n = model.range_sizes.size();
+            if (n > 0 && model.dim != dim_)
+                throw Exception("planner model was measured at dim " + std::to_string(model.dim) + ", the index has dim " + std::to_string(dim_));
+            if (model.graph_ns.size() != n || model.graph_ef_ns.size() != n || !std::is_sorted(model.range_sizes.begin(), model.range_sizes.end()))
+                throw Exception("planner model needs one graph cost per range size, by increasing size");
+            planner_ = model;
+        }
+
+        // Measures the planner's cost model on this machine and index: exact scans at two k of random slices of
+        // the data, and graph searches at two ef over random ranges of a few sizes from 2^10 to 2^16 points, all
+        // with data points as queries. The samples are fixed, so only the timings vary from run to run. Takes some
+        // tens of milliseconds; leaves the planner without a model for indexes of fewer than 2^10 points.
+        void CalibratePlanner(int samples = 32)
+        {
+            planner_ = PlannerModel();
+            long long leaf_span = tree->node_span(tree->max_depth);
+            std::vector<long long> sizes;
+            if (tree->max_depth > 0)
+            {
+                for (long long size = std::max<long long>(1 << 10, 4 * leaf_span); size <= std::min<long long>(max_elements_, 1 << 16); size *= 4)
+                    sizes.push_back(size);
+            }
+            if (sizes.empty())
+                return;
+
+            std::default_random_engine e(0);
+            std::uniform_int_distribution<int> u_query(0, max_elements_ - 1);
+            std::vector<int> queries(samples), starts(samples);
+            std::vector<TreeNode> filterednodes(tree->max_filtered_nodes());
+            searcher::SearchContext *ctx = context_pool_->get();
+            auto time_ns = [&](std::function<void(int)> run)
+            {
+                // the first round warms the caches up and is not counted
+                std::chrono::steady_clock::time_point begin;
+                for (int round = 0; round < 2; round++)
+                {
+                    begin = std::chrono::steady_clock::now();
+                    for (int i = 0; i < samples; i++)
+                        run(i);
+                }
+                return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / samples;
+            };
+
+            PlannerModel model;
+            model.dim = dim_;
+            // scan totals at the two k: time, points and expected heap updates
+            double scan_ns[2] = {0, 0}, updates[2] = {0, 0}, scanned = 0;
+            const int low_k = 10, high_k = 100;
+            const int low_ef = 16, high_ef = 128;
+            for (long long range_size : sizes)
+            {
+                std::uniform_int_distribution<int> u_start(0, max_elements_ - range_size);
+                for (int i = 0; i < samples; i++)
+                {
+                    queries[i] = u_query(e);
+                    starts[i] = u_start(e);
+                }
+                for (int j = 0; j < 2; j++)
+                {
+                    int k = j == 0 ? low_k : high_k;
+                    scan_ns[j] += time_ns([&](int i)
+                                          {
+                        ctx->begin(starts[i], starts[i] + range_size - 1);
+                        ScanRange(*ctx, starts[i], starts[i] + range_size - 1, getDataByInternalId(queries[i]), k); });
+                    updates[j] += HeapUpdates(range_size, k);
+                }
+                scanned += range_size;
+                double graph_ns[2];
+                for (int j = 0; j < 2; j++)
+                {
+                    int ef = j == 0 ? low_ef : high_ef;
+                    graph_ns[j] = time_ns([&](int i)
+                                          {
+                        int ql = starts[i], qr = starts[i] + range_size - 1;
+                        int filtered_num = tree->range_filter(ql, qr, filterednodes.data());
+                        ctx->begin(ql, qr);
+                        ctx->pool.reset(ef, 2 * ef);
+                        GraphSearch(*ctx, ctx->pool, filterednodes.data(), filtered_num, getDataByInternalId(queries[i]), ql, qr, M_out); });
+                }
+                double ef_ns = std::max(0.0, (graph_ns[1] - graph_ns[0]) / (high_ef - low_ef));
+                model.range_sizes.push_back(range_size);
+                model.graph_ef_ns.push_back(ef_ns);
+                model.graph_ns.push_back(std::max(0.0, graph_ns[0] - ef_ns * low_ef));
+            }
+            ctx->distance_computations = ctx->hops = 0;
+            context_pool_->release(ctx);
+            model.scan_k_ns = std::max(0.0, (scan_ns[1] - scan_ns[0]) / (updates[1] - updates[0]));
+            model.scan_ns = std::max(0.0, scan_ns[0] - model.scan_k_ns * updates[0]) / scanned;
+            planner_ = model;
+        }
+
+        // Best-first search over [QL, QR] from the filtered nodes; pool is a searcher::LinearPool or HeapPool.
+        template <typename Pool>
+        void GraphSearch(searcher::SearchContext &ctx, Pool &pool, const TreeNode *filterednodes, int filtered_num, const void *query_data, int QL, int QR, int edge_limit)
         {
             // To fix the starting points for different 'ef' parameter, set seed to a fixed number, e.g., seed =0
             // unsigned seed = 0;
             unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
             std::default_random_engine e(seed);
 
-            std::priority_queue<PFI, std::vector<PFI>, std::greater<PFI>> candidate_set;
-            std::priority_queue<PFI> top_candidates;
-            searcher::Bitset<uint64_t> visited_set(max_elements_);
-
-            for (auto u : filterednodes)
+            int top_depth = tree->lca_depth(QL, QR);
+            for (int i = 0; i < filtered_num; i++)
             {
-                std::uniform_int_distribution<int> u_start(u->lbound, u->rbound);
+                const auto &u = filterednodes[i];
+                if (tree->is_leaf(u))
+                    continue;
+                std::uniform_int_distribution<int> u_start(u.lbound, u.rbound);
                 int pid = u_start(e);
-                visited_set.set(pid);
+                ctx.set_visited(pid);
                 char *ep_data = getDataByInternalId(pid);
                 float dis = fstdistfunc_(query_data, ep_data, dist_func_param_);
-                candidate_set.emplace(dis, pid);
-                top_candidates.emplace(dis, pid);
+                pool.insert(pid, dis, isDeleted(pid));
             }
 
-            float lowerBound = top_candidates.top().first;
-
-            while (!candidate_set.empty())
+            auto scan = [&](int l, int r)
             {
-                auto current_point_pair = candidate_set.top();
-                ++metric_hops;
-                if (current_point_pair.first > lowerBound)
+                for (int pid = l; pid <= r; pid++)
                 {
-                    break;
+                    if (pid + 1 <= r)
+                        memory::mem_prefetch_L1(getDataByInternalId(pid + 1), this->prefetch_lines);
+                    ctx.set_visited(pid);
+                    pool.insert(pid, fstdistfunc_(query_data, getDataByInternalId(pid), dist_func_param_), isDeleted(pid));
                 }
-                candidate_set.pop();
-                int current_pid = current_point_pair.second;
-                auto selected_edges = SelectEdge(current_pid, QL, QR, edge_limit, visited_set);
-                int num_edges = selected_edges.size();
+                ctx.distance_computations += r - l + 1;
+            };
+            tree->for_each_scanned_leaf(QL, QR, filterednodes, filtered_num, scan);
+
+            while (pool.has_next())
+            {
+                ++ctx.hops;
+                int current_pid = pool.pop();
+                int num_edges = SelectEdge(current_pid, QL, QR, edge_limit, ctx, top_depth);
+                const int *selected_edges = ctx.edges.data();
                 for (int i = 0; i < std::min(num_edges, 3); ++i)
                 {
                     memory::mem_prefetch_L1(getDataByInternalId(selected_edges[i]), this->prefetch_lines);
@@ -220,35 +1197,27 @@ namespace iRangeGraph
                 {
                     int neighbor_id = selected_edges[i];
 
-                    if (visited_set.get(neighbor_id))
+                    if (ctx.is_visited(neighbor_id))
                         continue;
-                    visited_set.set(neighbor_id);
+                    ctx.set_visited(neighbor_id);
                     char *neighbor_data = getDataByInternalId(neighbor_id);
                     float dis = fstdistfunc_(query_data, neighbor_data, dist_func_param_);
-                    ++metric_distance_computations;
+                    ++ctx.distance_computations;
 
-                    if (top_candidates.size() < ef)
-                    {
-                        candidate_set.emplace(dis, neighbor_id);
-                        top_candidates.emplace(dis, neighbor_id);
-                        lowerBound = top_candidates.top().first;
-                    }
-                    else if (dis < lowerBound)
-                    {
-                        candidate_set.emplace(dis, neighbor_id);
-                        top_candidates.emplace(dis, neighbor_id);
-                        top_candidates.pop();
-                        lowerBound = top_candidates.top().first;
-                    }
+                    pool.insert(neighbor_id, dis, isDeleted(neighbor_id));
                 }
             }
-            while (top_candidates.size() > query_k)
-                top_candidates.pop();
-            return top_candidates;
         }
 
-        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit)
+        // With threads > 1, every ef is also run as one searchBatch on that many threads, and its QPS is added as
+        // a last column.
+        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit, int threads = 1)
         {
+            if (storage == nullptr)
+                throw Exception("search() benchmarks the queries of a DataLoader; the index was opened without one");
+            std::vector<TreeNode> filterednodes(tree->max_filtered_nodes());
+            searcher::SearchContext *ctx = context_pool_->get();
+            std::cout << "layout = " << (layout_ == kLayerMajor ? "layer-major" : "point-major") << std::endl;
             for (auto range : storage->query_range)
             {
                 int suffix = range.first;
@@ -263,58 +1232,83 @@ namespace iRangeGraph
                 std::vector<int> DCO;
                 std::vector<float> QPS;
                 std::vector<float> RECALL;
+                std::vector<float> HEAP_QPS;
+                std::vector<float> HEAP_RECALL;
+                std::vector<float> BATCH_QPS;
 
                 std::cout << "suffix = " << suffix << std::endl;
                 for (auto ef : SearchEF)
                 {
-                    int tp = 0;
-                    float searchtime = 0;
+                    // each ef is run with the linear pool, then again with the heaps for comparison
+                    for (int use_heap = 0; use_heap < 2; use_heap++)
+                    {
+                        int tp = 0;
+                        float searchtime = 0;
 
-                    metric_hops = 0;
-                    metric_distance_computations = 0;
+                        metric_hops = 0;
+                        metric_distance_computations = 0;
 
-                    for (int i = 0; i < storage->query_nb; i++)
-                    {
-                        auto rp = range.second[i];
-                        int ql = rp.first, qr = rp.second;
+                        for (int i = 0; i < storage->query_nb; i++)
+                        {
+                            auto rp = range.second[i];
+                            int ql = rp.first, qr = rp.second;
+
+                            timeval t1, t2;
+                            gettimeofday(&t1, NULL);
+                            int filtered_num = tree->range_filter(ql, qr, filterednodes.data());
+                            TopDown_nodeentries_search(*ctx, filterednodes.data(), filtered_num, storage->query_points[i].data(), ef, storage->query_K, ql, qr, edge_limit, use_heap);
+                            gettimeofday(&t2, NULL);
+                            MergeMetrics(*ctx);
+                            auto duration = GetTime(t1, t2);
+                            searchtime += duration;
+                            std::map<int, int> record;
+                            for (auto &res : ctx->top)
+                            {
+                                auto x = res.second;
+                                if (record.count(x))
+                                    throw Exception("repetitive search results");
+                                record[x] = 1;
+                                if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
+                                    tp++;
+                            }
+                        }
 
+                        float recall = 1.0 * tp / storage->query_nb / storage->query_K;
+                        float qps = storage->query_nb / searchtime;
+                        float dco = metric_distance_computations * 1.0 / storage->query_nb;
+                        float hop = metric_hops * 1.0 / storage->query_nb;
+
+                        if (use_heap)
+                        {
+                            HEAP_QPS.emplace_back(qps);
+                            HEAP_RECALL.emplace_back(recall);
+                            continue;
+                        }
+                        HOP.emplace_back(hop);
+                        DCO.emplace_back(dco);
+                        QPS.emplace_back(qps);
+                        RECALL.emplace_back(recall);
+                    }
+                    if (threads > 1)
+                    {
                         timeval t1, t2;
                         gettimeofday(&t1, NULL);
-                        std::vector<TreeNode *> filterednodes = tree->range_filter(tree->root, ql, qr);
-                        std::priority_queue<PFI> res = TopDown_nodeentries_search(filterednodes, storage->query_points[i].data(), ef, storage->query_K, ql, qr, edge_limit);
+                        searchBatch(storage->query_points, range.second, storage->query_K, ef, threads);
                         gettimeofday(&t2, NULL);
-                        auto duration = GetTime(t1, t2);
-                        searchtime += duration;
-                        std::map<int, int> record;
-                        while (res.size())
-                        {
-                            auto x = res.top().second;
-                            res.pop();
-                            if (record.count(x))
-                                throw Exception("repetitive search results");
-                            record[x] = 1;
-                            if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
-                                tp++;
-                        }
+                        BATCH_QPS.emplace_back(storage->query_nb / GetTime(t1, t2));
                     }
-
-                    float recall = 1.0 * tp / storage->query_nb / storage->query_K;
-                    float qps = storage->query_nb / searchtime;
-                    float dco = metric_distance_computations * 1.0 / storage->query_nb;
-                    float hop = metric_hops * 1.0 / storage->query_nb;
-
-                    HOP.emplace_back(hop);
-                    DCO.emplace_back(dco);
-                    QPS.emplace_back(qps);
-                    RECALL.emplace_back(recall);
                 }
 
-                for (int i = 0; i < RECALL.size(); i++)
+                for (size_t i = 0; i < RECALL.size(); i++)
                 {
-                    outfile << SearchEF[i] << "," << RECALL[i] << "," << QPS[i] << "," << DCO[i] << "," << HOP[i] << std::endl;
+                    outfile << SearchEF[i] << "," << RECALL[i] << "," << QPS[i] << "," << DCO[i] << "," << HOP[i] << "," << HEAP_RECALL[i] << "," << HEAP_QPS[i];
+                    if (threads > 1)
+                        outfile << "," << BATCH_QPS[i];
+                    outfile << std::endl;
                 }
                 outfile.close();
             }
+            context_pool_->release(ctx);
         }
     };
 }
\ No newline at end of file
@@ -0,0 +1,497 @@
+#pragma once
+
+#include "iRG_search.h"
+#include "disk_io.hpp"
+
+namespace iRangeGraph
+{
+    // Searches an index that stays on disk. Only the tree and one byte per dimension and point (a scalar
+    // quantization of the vectors) are kept in memory. The search navigates with the quantized distances and reads
+    // the block of every point it expands, a beam of beam_width points per batch of reads; the exact vector that
+    // comes with each block re-ranks the expanded points.
+    template <typename dist_t>
+    class iRangeGraph_DiskSearch
+    {
+    public:
+        DataLoader *storage;
+        std::unique_ptr<SegmentTree> tree;
+        DiskIndexHeader header_;
+        size_t max_elements_{0};
+        size_t dim_{0};
+        size_t M_out{0};
+        int beam_width_{4};
+
+        std::vector<float> sq_min_, sq_step_;
+        uint8_t *codes_{nullptr};
+        std::vector<int> layer_width_;
+        std::vector<size_t> list_offset_;
+
+        std::unique_ptr<diskio::BlockReader> reader_;
+        char *scratch_{nullptr};
+        size_t scratch_sectors_{0};
+
+        // scratch state of the last query, kept for the next one: visited marks over the range, the candidate pool
+        // and the results, the beam and its blocks, the edges of a hop and the reads of a batch
+        std::unique_ptr<searcher::SearchContext> ctx_;
+        std::vector<int> beam_;
+        std::vector<const char *> blocks_;
+        std::vector<tableint> selected_edges_;
+        std::vector<uint64_t> sectors_;
+        std::vector<size_t> slots_;
+        std::vector<diskio::ReadRequest> requests_;
+
+        std::unique_ptr<hnswlib::L2Space> space;
+        hnswlib::DISTFUNC<dist_t> fstdistfunc_;
+        void *dist_func_param_{nullptr};
+
+        size_t metric_distance_computations{0};
+        size_t metric_hops{0};
+        size_t metric_sectors{0};
+
+        iRangeGraph_DiskSearch(std::string diskfilename, DataLoader *store, int beam_width = 4) : storage(store), beam_width_(beam_width)
+        {
+            std::ifstream diskfile(diskfilename, std::ios::in | std::ios::binary | std::ios::ate);
+            if (!diskfile.is_open())
+                throw Exception("cannot open " + diskfilename);
+            uint64_t file_size = diskfile.tellg();
+            diskfile.seekg(0);
+            diskfile.read((char *)&header_, sizeof(header_));
+            if (diskfile.fail() || header_.magic != kDiskMagic)
+                throw Exception(diskfilename + " is not an iRangeGraph disk index");
+            if (header_.version != kDiskVersion)
+                throw Exception(diskfilename + " has disk index version " + std::to_string(header_.version) + ", this build reads version " +
+                                std::to_string(kDiskVersion));
+            if (header_.header_checksum != DiskHeaderChecksum(header_))
+                throw Exception(diskfilename + " has a corrupted header");
+            if (header_.nb == 0 || header_.dim == 0 || header_.M == 0 || header_.fanout < 2 || header_.leaf_size == 0)
+                throw Exception(diskfilename + " has an invalid header");
+            max_elements_ = header_.nb;
+            dim_ = header_.dim;
+            M_out = header_.M;
+
+            tree.reset(new SegmentTree(max_elements_, header_.fanout, header_.leaf_size));
+            if (tree->max_depth != (int)header_.layer_num)
+                throw Exception(diskfilename + " does not match its tree");
+            size_t node_bytes = InitNodeLayout(*tree, dim_, M_out, layer_width_, list_offset_);
+            // every section has to be where the writer puts it, and the node blocks have to end inside the file
+            uint64_t quantizer_end = sizeof(header_) + 2 * dim_ * sizeof(float);
+            uint64_t codes_end = header_.codes_offset + (uint64_t)max_elements_ * dim_;
+            if (header_.node_bytes != node_bytes || header_.nodes_per_sector == 0 || header_.sectors_per_node == 0 ||
+                (uint64_t)header_.nodes_per_sector * header_.node_bytes > (uint64_t)header_.sectors_per_node * diskio::kSectorBytes ||
+                header_.codes_offset < quantizer_end || header_.nodes_offset < codes_end || header_.nodes_offset % diskio::kSectorBytes != 0)
+                throw Exception(diskfilename + " has an invalid layout");
+            if (file_size < NodesEnd(header_))
+                throw Exception(diskfilename + " is truncated");
+
+            sq_min_.resize(dim_);
+            sq_step_.resize(dim_);
+            diskfile.read((char *)sq_min_.data(), dim_ * sizeof(float));
+            diskfile.read((char *)sq_step_.data(), dim_ * sizeof(float));
+            uint32_t quantizer_checksum = Crc32c(Crc32c(0, sq_min_.data(), dim_ * sizeof(float)), sq_step_.data(), dim_ * sizeof(float));
+            if (diskfile.fail() || quantizer_checksum != header_.quantizer_checksum)
+                throw Exception(diskfilename + " has a corrupted quantizer");
+            codes_ = (uint8_t *)memory::align_mm<64>(max_elements_ * dim_);
+            if (codes_ == nullptr)
+                throw std::runtime_error("Not enough memory");
+            diskfile.seekg(header_.codes_offset);
+            diskfile.read((char *)codes_, max_elements_ * dim_);
+            if (diskfile.fail() || Crc32c(0, codes_, max_elements_ * dim_) != header_.codes_checksum)
+            {
+                free(codes_);
+                codes_ = nullptr;
+                throw Exception(diskfilename + " has corrupted codes");
+            }
+            diskfile.close();
+
+            space.reset(new hnswlib::L2Space(dim_));
+            fstdistfunc_ = space->get_dist_func();
+            dist_func_param_ = space->get_dist_func_param();
+            // a hop selects at most one list from each layer
+            ctx_.reset(new searcher::SearchContext(M_out * std::max(tree->max_depth, 1), max_elements_));
+
+            reader_.reset(new diskio::BlockReader(diskfilename));
+            std::cout << "load disk index finished, codes: " << max_elements_ * dim_ / (1 << 20) << " MB in memory, reads: "
+                      << reader_->engine() << (reader_->direct() ? " with O_DIRECT" : "") << std::endl;
+        }
+
+        ~iRangeGraph_DiskSearch()
+        {
+            free(codes_);
+            free(scratch_);
+        }
+
+        // Lists are stored behind the vector, layer by layer, at the widths of the in-memory search; returns the
+        // size of a node block.
+        static size_t InitNodeLayout(const SegmentTree &tree, size_t dim, size_t M, std::vector<int> &width, std::vector<size_t> &offset)
+        {
+            size_t node_bytes = dim * sizeof(float);
+            width.resize(tree.max_depth);
+            offset.resize(tree.max_depth);
+            for (int layer = 0; layer < tree.max_depth; layer++)
+            {
+                width[layer] = iRangeGraph_Search<dist_t>::ListWidth(tree.node_span(layer));
+                node_bytes = (node_bytes + width[layer] - 1) / width[layer] * width[layer];
+                offset[layer] = node_bytes;
+                node_bytes += (M + 1) * width[layer];
+            }
+            return (node_bytes + 3) / 4 * 4;
+        }
+
+        // Writes the disk index of an index file. The vectors are read twice: once to fit the quantizer and once to
+        // write them and their codes.
+        static void BuildDiskIndex(std::string indexfilename, std::string diskfilename)
+        {
+            IndexReader reader(indexfilename);
+            const IndexHeader &index_header = reader.header;
+            SegmentTree tree(index_header.nb, index_header.fanout, index_header.leaf_size);
+            reader.CheckTree(tree);
+
+            DiskIndexHeader header;
+            header.nb = index_header.nb;
+            header.dim = index_header.dim;
+            header.M = index_header.M;
+            header.fanout = index_header.fanout;
+            header.leaf_size = index_header.leaf_size;
+            header.layer_num = tree.max_depth;
+            std::vector<int> width;
+            std::vector<size_t> offset;
+            header.node_bytes = InitNodeLayout(tree, header.dim, header.M, width, offset);
+            if (header.node_bytes <= diskio::kSectorBytes)
+            {
+                header.nodes_per_sector = diskio::kSectorBytes / header.node_bytes;
+                header.sectors_per_node = 1;
+            }
+            else
+            {
+                header.nodes_per_sector = 1;
+                header.sectors_per_node = (header.node_bytes + diskio::kSectorBytes - 1) / diskio::kSectorBytes;
+            }
+            auto align = [](uint64_t bytes)
+            { return (bytes + diskio::kSectorBytes - 1) / diskio::kSectorBytes * diskio::kSectorBytes; };
+            header.codes_offset = align(sizeof(header) + 2 * header.dim * sizeof(float));
+            header.nodes_offset = align(header.codes_offset + (uint64_t)header.nb * header.dim);
+            uint64_t file_size = NodesEnd(header);
+
+            CheckPath(diskfilename);
+            int fd = open(diskfilename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (fd < 0)
+                throw Exception("cannot open " + diskfilename);
+            if (ftruncate(fd, file_size) != 0)
+            {
+                close(fd);
+                throw Exception("cannot resize " + diskfilename);
+            }
+            std::atomic<bool> failed{false};
+            auto write_at = [&](const void *buffer, size_t bytes, uint64_t offset)
+            {
+                if (pwrite(fd, buffer, bytes, offset) != (ssize_t)bytes)
+                    failed = true;
+            };
+            auto node_offset = [&](size_t pid)
+            {
+                return header.nodes_offset + NodeSector(header, pid) * diskio::kSectorBytes + pid % header.nodes_per_sector * header.node_bytes;
+            };
+
+            // the quantizer maps [min, max] of every dimension to 0..255
+            std::vector<float> sq_min(header.dim, std::numeric_limits<float>::max());
+            std::vector<float> sq_max(header.dim, std::numeric_limits<float>::lowest());
+            size_t threads = reader.threads;
+            reader.threads = 1;
+            reader.read_vectors([&](size_t, const float *vector)
+                                {
+                                    for (size_t d = 0; d < header.dim; d++)
+                                    {
+                                        sq_min[d] = std::min(sq_min[d], vector[d]);
+                                        sq_max[d] = std::max(sq_max[d], vector[d]);
+                                    } });
+            reader.threads = threads;
+            std::vector<float> sq_step(header.dim);
+            for (size_t d = 0; d < header.dim; d++)
+                sq_step[d] = (sq_max[d] - sq_min[d]) / 255;
+
+            reader.read_vectors([&](size_t pid, const float *vector)
+                                {
+                                    std::vector<uint8_t> code(header.dim);
+                                    for (size_t d = 0; d < header.dim; d++)
+                                        code[d] = sq_step[d] > 0 ? std::min(255.0f, std::round((vector[d] - sq_min[d]) / sq_step[d])) : 0;
+                                    write_at(code.data(), header.dim, header.codes_offset + pid * header.dim);
+                                    write_at(vector, header.dim * sizeof(float), node_offset(pid)); });
+
+            for (int layer = 0; layer < (int)header.layer_num; layer++)
+            {
+                long long span = tree.node_span(layer);
+                reader.read_layer(layer, [&](size_t pid, const int *record)
+                                  {
+                                      std::vector<char> list((header.M + 1) * width[layer], 0);
+                                      int base = width[layer] == 4 ? 0 : pid / span * span;
+                                      for (int j = 0; j <= record[0]; j++)
+                                          iRangeGraph_Search<dist_t>::SetListEntry(list.data(), width[layer], base, j, record[j]);
+                                      write_at(list.data(), list.size(), node_offset(pid) + offset[layer]); });
+            }
+
+            // the codes are written out of order, so their checksum is taken from the file
+            std::vector<char> buffer(std::min<uint64_t>(64 << 20, (uint64_t)header.nb * header.dim));
+            for (uint64_t done = 0, bytes = (uint64_t)header.nb * header.dim; done < bytes && !failed;)
+            {
+                size_t block = std::min<uint64_t>(buffer.size(), bytes - done);
+                if (pread(fd, buffer.data(), block, header.codes_offset + done) != (ssize_t)block)
+                    failed = true;
+                header.codes_checksum = Crc32c(header.codes_checksum, buffer.data(), block);
+                done += block;
+            }
+            header.quantizer_checksum = Crc32c(Crc32c(0, sq_min.data(), header.dim * sizeof(float)), sq_step.data(), header.dim * sizeof(float));
+            header.header_checksum = DiskHeaderChecksum(header);
+
+            write_at(sq_min.data(), header.dim * sizeof(float), sizeof(header));
+            write_at(sq_step.data(), header.dim * sizeof(float), sizeof(header) + header.dim * sizeof(float));
+            write_at(&header, sizeof(header), 0);
+            bool synced = fsync(fd) == 0;
+            close(fd);
+            if (failed || !synced)
+                throw Exception("failed to write " + diskfilename);
+            std::cout << "disk index written: " << file_size / (1 << 20) << " MB, " << header.node_bytes << " bytes per node" << std::endl;
+        }
+
+        // Index of the first sector of a node's block, counted from nodes_offset.
+        static uint64_t NodeSector(const DiskIndexHeader &header, size_t pid)
+        {
+            return pid / header.nodes_per_sector * header.sectors_per_node;
+        }
+
+        // End of the last node block, which is the size of the file.
+        static uint64_t NodesEnd(const DiskIndexHeader &header)
+        {
+            return header.nodes_offset + (NodeSector(header, header.nb - 1) + header.sectors_per_node) * diskio::kSectorBytes;
+        }
+
+        inline float ApproxDistance(const float *query, int pid) const
+        {
+            const uint8_t *code = codes_ + (size_t)pid * dim_;
+            float dis = 0;
+            for (size_t d = 0; d < dim_; d++)
+            {
+                float diff = sq_min_[d] + code[d] * sq_step_[d] - query[d];
+                dis += diff * diff;
+            }
+            return dis;
+        }
+
+        // Reads the blocks of the given points in one batch; a sector holding several of them is read once.
+        void ReadNodes(const std::vector<int> &pids, std::vector<const char *> &blocks)
+        {
+            size_t sector_bytes = header_.sectors_per_node * diskio::kSectorBytes;
+            std::vector<uint64_t> &sectors = sectors_;
+            std::vector<size_t> &slots = slots_;
+            sectors.clear();
+            slots.resize(pids.size());
+            for (size_t i = 0; i < pids.size(); i++)
+            {
+                uint64_t sector = NodeSector(header_, pids[i]);
+                size_t slot = std::find(sectors.begin(), sectors.end(), sector) - sectors.begin();
+                if (slot == sectors.size())
+                    sectors.emplace_back(sector);
+                slots[i] = slot;
+            }
+            if (sectors.size() > scratch_sectors_)
+            {
+                free(scratch_);
+                scratch_sectors_ = sectors.size();
+                scratch_ = (char *)memory::align_mm<diskio::kSectorBytes>(scratch_sectors_ * sector_bytes);
+            }
+
+            requests_.clear();
+            for (size_t s = 0; s < sectors.size(); s++)
+                requests_.push_back({header_.nodes_offset + sectors[s] * diskio::kSectorBytes, sector_bytes, scratch_ + s * sector_bytes});
+            reader_->read(requests_);
+            metric_sectors += sectors.size() * header_.sectors_per_node;
+
+            blocks.resize(pids.size());
+            for (size_t i = 0; i < pids.size(); i++)
+                blocks[i] = scratch_ + slots[i] * sector_bytes + pids[i] % header_.nodes_per_sector * header_.node_bytes;
+        }
+
+        template <typename id_t>
+        bool CollectEdges(const id_t *data, int base, int ql, int qr, size_t edge_limit, std::vector<tableint> &selected_edges)
+        {
+            size_t size = data[0];
+            for (size_t j = 1; j <= size; ++j)
+            {
+                int neighborId = base + data[j];
+                if (neighborId < ql || neighborId > qr || ctx_->is_visited(neighborId))
+                    continue;
+                selected_edges.emplace_back(neighborId);
+                if (selected_edges.size() == edge_limit)
+                    return true;
+            }
+            return false;
+        }
+
+        // The layers iRangeGraph_Search::SelectEdge reads, over the lists of a node block; leaves the unvisited
+        // neighbors in selected_edges.
+        void SelectEdge(int pid, const char *block, int ql, int qr, int edge_limit, int top_depth, std::vector<tableint> &selected_edges)
+        {
+            selected_edges.clear();
+            tree->for_each_split_layer(pid, ql, qr, top_depth, [&](int depth, int lbound)
+                                       {
+                const char *data = block + list_offset_[depth];
+                switch (layer_width_[depth])
+                {
+                case 1:
+                    return CollectEdges((const uint8_t *)data, lbound, ql, qr, edge_limit, selected_edges);
+                case 2:
+                    return CollectEdges((const uint16_t *)data, lbound, ql, qr, edge_limit, selected_edges);
+                default:
+                    return CollectEdges((const int *)data, 0, ql, qr, edge_limit, selected_edges);
+                } });
+        }
+
+        // The search keeps its candidates in the pooled context: the ef closest points by quantized distance in
+        // ctx_->pool, the query_k closest expanded points by exact distance in ctx_->top, as a max-heap.
+        std::priority_queue<PFI> TopDown_nodeentries_search(const TreeNode *filterednodes, int filtered_num, const float *query_data, int ef, int query_k, int QL, int QR, int edge_limit)
+        {
+            unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
+            std::default_random_engine e(seed);
+
+            searcher::SearchContext &ctx = *ctx_;
+            ctx.begin(QL, QR);
+            std::vector<PFI> &results = ctx.top;
+            std::vector<int> &beam = beam_;
+            std::vector<const char *> &blocks = blocks_;
+            beam.clear();
+            auto rerank = [&](int pid, const char *block)
+            {
+                float dis = fstdistfunc_(query_data, block, dist_func_param_);
+                ++metric_distance_computations;
+                if (results.size() < (size_t)query_k)
+                {
+                    results.emplace_back(dis, pid);
+                    std::push_heap(results.begin(), results.end());
+                }
+                else if (dis < results.front().first)
+                {
+                    std::pop_heap(results.begin(), results.end());
+                    results.back() = PFI(dis, pid);
+                    std::push_heap(results.begin(), results.end());
+                }
+            };
+
+            // a range inside a single leaf is read and scanned exactly
+            long long leaf_span = tree->node_span(tree->max_depth);
+            if (QL / leaf_span == QR / leaf_span)
+            {
+                for (int pid = QL; pid <= QR; pid++)
+                    beam.emplace_back(pid);
+                ReadNodes(beam, blocks);
+                for (size_t i = 0; i < beam.size(); i++)
+                    rerank(beam[i], blocks[i]);
+                return std::priority_queue<PFI>(results.begin(), results.end());
+            }
+
+            searcher::LinearPool &pool = ctx.pool;
+            pool.reset(ef, ef);
+            int top_depth = tree->lca_depth(QL, QR);
+            auto visit = [&](int pid)
+            {
+                ctx.set_visited(pid);
+                pool.insert(pid, ApproxDistance(query_data, pid));
+            };
+
+            for (int i = 0; i < filtered_num; i++)
+            {
+                const auto &u = filterednodes[i];
+                if (tree->is_leaf(u))
+                    continue;
+                std::uniform_int_distribution<int> u_start(u.lbound, u.rbound);
+                visit(u_start(e));
+            }
+            // leaves are scanned with the codes, which are in memory
+            auto scan = [&](int l, int r)
+            {
+                for (int pid = l; pid <= r; pid++)
+                    visit(pid);
+            };
+            tree->for_each_scanned_leaf(QL, QR, filterednodes, filtered_num, scan);
+
+            while (true)
+            {
+                beam.clear();
+                while (pool.has_next() && beam.size() < (size_t)beam_width_)
+                    beam.emplace_back(pool.pop());
+                if (beam.empty())
+                    break;
+                metric_hops += beam.size();
+                ReadNodes(beam, blocks);
+                for (size_t b = 0; b < beam.size(); b++)
+                {
+                    rerank(beam[b], blocks[b]);
+                    SelectEdge(beam[b], blocks[b], QL, QR, edge_limit, top_depth, selected_edges_);
+                    for (auto neighbor_id : selected_edges_)
+                    {
+                        if (ctx.is_visited(neighbor_id))
+                            continue;
+                        visit(neighbor_id);
+                    }
+                }
+            }
+            return std::priority_queue<PFI>(results.begin(), results.end());
+        }
+
+        void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit)
+        {
+            std::vector<TreeNode> filterednodes(tree->max_filtered_nodes());
+            for (auto range : storage->query_range)
+            {
+                int suffix = range.first;
+                std::vector<std::vector<int>> &gt = storage->groundtruth[suffix];
+                std::string savepath = saveprefix + std::to_string(suffix) + ".csv";
+                CheckPath(savepath);
+                std::ofstream outfile(savepath);
+                if (!outfile.is_open())
+                    throw Exception("cannot open " + savepath);
+
+                std::cout << "suffix = " << suffix << std::endl;
+                for (auto ef : SearchEF)
+                {
+                    int tp = 0;
+                    float searchtime = 0;
+
+                    metric_hops = 0;
+                    metric_distance_computations = 0;
+                    metric_sectors = 0;
+
+                    for (int i = 0; i < storage->query_nb; i++)
+                    {
+                        auto rp = range.second[i];
+                        int ql = rp.first, qr = rp.second;
+
+                        timeval t1, t2;
+                        gettimeofday(&t1, NULL);
+                        int filtered_num = tree->range_filter(ql, qr, filterednodes.data());
+                        std::priority_queue<PFI> res = TopDown_nodeentries_search(filterednodes.data(), filtered_num, storage->query_points[i].data(), ef, storage->query_K, ql, qr, edge_limit);
+                        gettimeofday(&t2, NULL);
+                        searchtime += GetTime(t1, t2);
+                        std::map<int, int> record;
+                        while (res.size())
+                        {
+                            auto x = res.top().second;
+                            res.pop();
+                            if (record.count(x))
+                                throw Exception("repetitive search results");
+                            record[x] = 1;
+                            if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
+                                tp++;
+                        }
+                    }
+
+                    float recall = 1.0 * tp / storage->query_nb / storage->query_K;
+                    float qps = storage->query_nb / searchtime;
+                    float dco = metric_distance_computations * 1.0 / storage->query_nb;
+                    float hop = metric_hops * 1.0 / storage->query_nb;
+                    float ios = metric_sectors * 1.0 / storage->query_nb;
+                    outfile << ef << "," << recall << "," << qps << "," << dco << "," << hop << "," << ios << std::endl;
+                }
+                outfile.close();
+            }
+        }
+    };
+}
@@ -1,4 +1,6 @@
 #include "utils_multi.h"
+#include "index_io.h"
+#include "searcher.hpp"
 
 namespace iRangeGraph_multi
 {
@@ -37,32 +39,42 @@ namespace iRangeGraph_multi
         size_t metric_distance_computations{0};
         size_t metric_hops{0};
 
-        std::vector<int> visitedpool;
-        size_t visited_tag{0};
+        std::vector<unsigned> visitedpool;
+        unsigned visited_tag{0};
+        // candidate pools, reused from query to query, and the step of every point inserted into them: -1 for a
+        // point within the attribute ranges, otherwise the number of hops since the last such point
+        searcher::LinearPool pool_;
+        searcher::HeapPool heap_;
+        std::vector<int> steps_;
+        // Pool slots, beyond ef, are kept for points outside the attribute ranges that are closer than the ef-th
+        // result. About ef * (1 - p) / p such points are expected when a fraction p of the range passes the
+        // attribute filters; the pool holds routing_factor times that.
+        double routing_factor{4};
 
         // purepost = True -> p=1   purepost =  False -> 0<=p<=1
         bool purepost{true};
 
-        iRangeGraph_Search_Multi(std::string edgefilename, DataLoader *store, int M) : storage(store)
+        // M may be left 0 to take it from the index file; otherwise it has to match.
+        iRangeGraph_Search_Multi(std::string edgefilename, DataLoader *store, int M = 0) : storage(store), pool_(store->data_nb, 0)
         {
-            std::ifstream edgefile(edgefilename, std::ios::in | std::ios::binary);
-            if (!edgefile.is_open())
-                throw Exception("cannot open " + edgefilename);
 
             max_elements_ = storage->data_nb;
             dim_ = storage->Dim;
-            tree = new iRangeGraph::SegmentTree(max_elements_);
-            tree->BuildTree(tree->root);
+            iRangeGraph::IndexReader reader(edgefilename);
+            CheckHeader(reader.header, M);
+            tree = new iRangeGraph::SegmentTree(max_elements_, reader.header.fanout, reader.header.leaf_size);
 
             space = new hnswlib::L2Space(dim_);
             fstdistfunc_ = space->get_dist_func();
             dist_func_param_ = space->get_dist_func_param();
-            M_out = M;
+            M_out = reader.header.M;
             visitedpool.resize(max_elements_);
+            steps_.resize(max_elements_);
 
             data_size_ = dim_ * sizeof(float);
             size_links_per_layer_ = M_out * sizeof(tableint) + sizeof(linklistsizeint);
-            size_links_per_element_ = size_links_per_layer_ * (tree->max_depth + 1);
+            // the leaves (layer max_depth) have no graph and get no link slots
+            size_links_per_element_ = size_links_per_layer_ * tree->max_depth;
             size_data_per_element_ = size_links_per_element_ + data_size_;
             offsetData_ = size_links_per_element_;
 
@@ -70,27 +82,16 @@ namespace iRangeGraph_multi
             if (data_memory_ == nullptr)
                 throw std::runtime_error("Not enough memory");
 
-            for (int pid = 0; pid < max_elements_; pid++)
-            {
-                for (int layer = 0; layer <= tree->max_depth; layer++)
-                {
-                    linklistsizeint *data = get_linklist(pid, layer);
-                    edgefile.read((char *)data, sizeof(tableint));
-                    int size = getListCount(data);
-                    if (size > M_out)
-                        throw Exception("real linklist size is bigger than defined M_out");
-                    for (int i = 0; i < size; i++)
-                    {
-                        char *current_neighbor_ = (char *)(data + 1 + i);
-                        edgefile.read(current_neighbor_, sizeof(tableint));
-                    }
-                }
+            reader.CheckTree(*tree);
+            reader.load_links([this](int pid, int layer)
+                              { return (char *)get_linklist(pid, layer); });
 
+            for (size_t pid = 0; pid < max_elements_; pid++)
+            {
                 size_t size_in_bytes = dim_ * sizeof(float);
                 char *data = getDataByInternalId(pid);
                 std::memcpy(data, reinterpret_cast<char *>(storage->data_points[pid].data()), size_in_bytes);
             }
-            edgefile.close();
         }
 
         ~iRangeGraph_Search_Multi()
@@ -119,6 +120,16 @@ namespace iRangeGraph_multi
             return randNum < probability[x] ? 1 : 0;
         }
 
+        void CheckHeader(const iRangeGraph::IndexHeader &header, int M)
+        {
+            if (header.nb != max_elements_)
+                throw Exception("index is built over " + std::to_string(header.nb) + " points, but the data has " + std::to_string(max_elements_));
+            if (header.dim != dim_)
+                throw Exception("index is built over " + std::to_string(header.dim) + "-dimensional data, but the data has " + std::to_string(dim_) + " dimensions");
+            if (M != 0 && header.M != (uint32_t)M)
+                throw Exception("index is built with M = " + std::to_string(header.M) + ", but M = " + std::to_string(M) + " is given");
+        }
+
         inline char *getDataByInternalId(tableint internal_id) const
         {
             return (data_memory_ + internal_id * size_data_per_element_ + offsetData_);
@@ -153,38 +164,13 @@ namespace iRangeGraph_multi
             return true;
         }
 
-        std::vector<std::pair<tableint, bool>> SelectEdge(int pid, int ql, int qr, int edge_limit, std::vector<std::pair<int, int>> &queryrange, int current_step)
+        // top_depth is tree->lca_depth(ql, qr), the same for every hop of a query.
+        std::vector<std::pair<tableint, bool>> SelectEdge(int pid, int ql, int qr, int edge_limit, std::vector<std::pair<int, int>> &queryrange, int current_step, int top_depth)
         {
-            iRangeGraph::TreeNode *cur_node = nullptr, *nxt_node = tree->root;
             std::vector<std::pair<tableint, bool>> selected_edges;
-            do
-            {
-                cur_node = nxt_node;
-                bool contain = false;
-                do
-                {
-                    contain = false;
-                    if (cur_node->childs.size() == 0)
-                        nxt_node = nullptr;
-                    else
-                    {
-                        for (int i = 0; i < cur_node->childs.size(); i++)
-                        {
-                            if (cur_node->childs[i]->lbound <= pid && cur_node->childs[i]->rbound >= pid)
-                            {
-                                nxt_node = cur_node->childs[i];
-                                break;
-                            }
-                        }
-                        if (GetOverLap(cur_node->lbound, cur_node->rbound, ql, qr) == GetOverLap(nxt_node->lbound, nxt_node->rbound, ql, qr))
-                        {
-                            cur_node = nxt_node;
-                            contain = true;
-                        }
-                    }
-                } while (contain);
-
-                int *data = (int *)get_linklist(pid, cur_node->depth);
+            tree->for_each_split_layer(pid, ql, qr, top_depth, [&](int depth, int)
+                                       {
+                int *data = (int *)get_linklist(pid, depth);
                 size_t size = getListCount((linklistsizeint *)data);
 
                 for (size_t j = 1; j <= size; j++)
@@ -201,49 +187,107 @@ namespace iRangeGraph_multi
                         continue;
 
                     selected_edges.emplace_back(neighborId, inrange);
-                    if (selected_edges.size() == edge_limit)
-                        return selected_edges;
+                    if (selected_edges.size() == (size_t)edge_limit)
+                        return true;
                 }
-
-            } while (cur_node->lbound < ql || cur_node->rbound > qr);
+                return false; });
             return selected_edges;
         }
 
-        std::priority_queue<PFI> TopDown_search(const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit, std::vector<std::pair<int, int>> queryrange, std::vector<iRangeGraph::TreeNode *> &filterednodes)
+        // With use_heap, the search keeps its candidates in heap_ instead of pool_.
+        std::priority_queue<PFI> TopDown_search(const void *query_data, int ef, int query_k, int QL, int QR, int edge_limit, std::vector<std::pair<int, int>> queryrange, const iRangeGraph::TreeNode *filterednodes, int filtered_num, bool use_heap = false)
         {
             visited_tag++;
+            std::priority_queue<PFI> top_candidates;
+
+            // a range inside a single leaf has no graph to search
+            long long leaf_span = tree->node_span(tree->max_depth);
+            if (QL / leaf_span == QR / leaf_span)
+            {
+                for (int pid = QL; pid <= QR; pid++)
+                {
+                    if (!CheckInQueryRange(pid, queryrange))
+                        continue;
+                    float dis = fstdistfunc_(query_data, getDataByInternalId(pid), dist_func_param_);
+                    top_candidates.emplace(dis, storage->original_id[pid]);
+                    if (top_candidates.size() > (size_t)query_k)
+                        top_candidates.pop();
+                }
+                metric_distance_computations += QR - QL + 1;
+                return top_candidates;
+            }
+
+            std::vector<PFI> res;
+            if (use_heap)
+            {
+                heap_.reset(ef);
+                GraphSearch(heap_, query_data, QL, QR, edge_limit, queryrange, filterednodes, filtered_num);
+                heap_.results(query_k, res);
+            }
+            else
+            {
+                pool_.reset(ef, ef + RoutingSlots(ef, QL, QR, queryrange));
+                GraphSearch(pool_, query_data, QL, QR, edge_limit, queryrange, filterednodes, filtered_num);
+                pool_.results(query_k, res);
+            }
+            for (auto &r : res)
+                top_candidates.emplace(r.first, storage->original_id[r.second]);
+            return top_candidates;
+        }
+
+        // Routing slots for a search over [QL, QR], with p estimated from points spread evenly over the range.
+        int RoutingSlots(int ef, int QL, int QR, std::vector<std::pair<int, int>> &queryrange)
+        {
+            int samples = std::min(QR - QL + 1, 256), hits = 0;
+            for (int i = 0; i < samples; i++)
+                hits += CheckInQueryRange(QL + (long long)i * (QR - QL + 1) / samples, queryrange);
+            double p = (hits + 1.0) / (samples + 1.0);
+            return std::min<double>(QR - QL + 1, routing_factor * ef * (1 - p) / p);
+        }
+
+        // Best-first search over [QL, QR] from the filtered nodes; pool is a searcher::LinearPool or HeapPool.
+        template <typename Pool>
+        void GraphSearch(Pool &pool, const void *query_data, int QL, int QR, int edge_limit, std::vector<std::pair<int, int>> &queryrange, const iRangeGraph::TreeNode *filterednodes, int filtered_num)
+        {
             unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
             std::default_random_engine e(seed);
 
-            std::priority_queue<PFII, std::vector<PFII>, std::greater<PFII>> candidate_set;
-            std::priority_queue<PFI> top_candidates;
+            auto insert = [&](int pid, float dis)
+            {
+                steps_[pid] = -1;
+                pool.insert(pid, dis, !CheckInQueryRange(pid, queryrange));
+            };
 
-            for (auto u : filterednodes)
+            for (int i = 0; i < filtered_num; i++)
             {
-                std::uniform_int_distribution<int> u_start(u->lbound, u->rbound);
+                const auto &u = filterednodes[i];
+                if (tree->is_leaf(u))
+                    continue;
+                std::uniform_int_distribution<int> u_start(u.lbound, u.rbound);
                 int pid = u_start(e);
                 visitedpool[pid] = visited_tag;
                 char *ep_data = getDataByInternalId(pid);
-                float dis = fstdistfunc_(query_data, ep_data, dist_func_param_);
-                candidate_set.emplace(std::make_pair(dis, std::make_pair(pid, -1)));
-                if (CheckInQueryRange(pid, queryrange))
-                    top_candidates.emplace(dis, storage->original_id[pid]);
+                insert(pid, fstdistfunc_(query_data, ep_data, dist_func_param_));
             }
+            auto scan = [&](int l, int r)
+            {
+                for (int pid = l; pid <= r; pid++)
+                {
+                    visitedpool[pid] = visited_tag;
+                    insert(pid, fstdistfunc_(query_data, getDataByInternalId(pid), dist_func_param_));
+                }
+                metric_distance_computations += r - l + 1;
+            };
+            tree->for_each_scanned_leaf(QL, QR, filterednodes, filtered_num, scan);
 
-            float lowerBound = std::numeric_limits<float>::max();
+            int top_depth = tree->lca_depth(QL, QR);
 
-            while (!candidate_set.empty())
+            while (pool.has_next())
             {
-                auto current_point_pair = candidate_set.top();
                 metric_hops++;
-                if (current_point_pair.first > lowerBound)
-                {
-                    break;
-                }
-                candidate_set.pop();
-                int current_pid = current_point_pair.second.first;
-                int current_step = current_point_pair.second.second;
-                auto selected_edges = SelectEdge(current_pid, QL, QR, edge_limit, queryrange, current_step);
+                int current_pid = pool.pop();
+                int current_step = steps_[current_pid];
+                auto selected_edges = SelectEdge(current_pid, QL, QR, edge_limit, queryrange, current_step, top_depth);
 
                 while (selected_edges.size())
                 {
@@ -259,31 +303,15 @@ namespace iRangeGraph_multi
                     float dis = fstdistfunc_(query_data, neighbor_data, dist_func_param_);
                     metric_distance_computations++;
 
-                    if (top_candidates.size() < ef || dis < lowerBound)
-                    {
-                        int next_step = current_step + 1;
-                        if (inrange)
-                        {
-                            top_candidates.emplace(dis, storage->original_id[neighbor_id]);
-                            next_step = -1;
-                        }
-                        candidate_set.emplace(std::make_pair(dis, std::make_pair(neighbor_id, next_step)));
-
-                        if (top_candidates.size() > ef)
-                            top_candidates.pop();
-                        if (top_candidates.size())
-                            lowerBound = top_candidates.top().first;
-                    }
+                    steps_[neighbor_id] = inrange ? -1 : current_step + 1;
+                    pool.insert(neighbor_id, dis, !inrange);
                 }
             }
-
-            while (top_candidates.size() > query_k)
-                top_candidates.pop();
-            return top_candidates;
         }
 
         void search(std::vector<int> &SearchEF, std::string saveprefix, int edge_limit = 32)
         {
+            std::vector<iRangeGraph::TreeNode> filterednodes(tree->max_filtered_nodes());
             for (auto range : storage->query_range)
             {
                 std::string domain = range.first;
@@ -301,55 +329,67 @@ namespace iRangeGraph_multi
                 std::vector<int> DCO;
                 std::vector<float> QPS;
                 std::vector<float> RECALL;
+                std::vector<float> HEAP_QPS;
+                std::vector<float> HEAP_RECALL;
 
                 for (auto ef : SearchEF)
                 {
-                    int tp = 0;
-                    float searchtime = 0;
+                    // each ef is run with the linear pool, then again with the heaps for comparison
+                    for (int use_heap = 0; use_heap < 2; use_heap++)
+                    {
+                        int tp = 0;
+                        float searchtime = 0;
 
-                    metric_hops = 0;
-                    metric_distance_computations = 0;
+                        metric_hops = 0;
+                        metric_distance_computations = 0;
 
-                    for (int i = 0; i < storage->query_nb; i++)
-                    {
-                        auto cons = range.second[i];
-                        int ql = storage->mapped_queryrange[domain][i].first;
-                        int qr = storage->mapped_queryrange[domain][i].second;
-
-                        timeval t1, t2;
-                        gettimeofday(&t1, NULL);
-                        auto filterednodes = tree->range_filter(tree->root, ql, qr);
-                        auto res = TopDown_search(storage->query_points[i].data(), ef, storage->query_K, ql, qr, edge_limit, cons.attr_constraints, filterednodes);
-                        gettimeofday(&t2, NULL);
-                        searchtime += GetTime(t1, t2);
-
-                        std::map<int, int> record;
-                        while (res.size())
+                        for (int i = 0; i < storage->query_nb; i++)
                         {
-                            auto x = res.top().second;
-                            res.pop();
-                            if (record.count(x))
-                                throw Exception("repetitive search results");
-                            record[x] = 1;
-                            if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
-                                tp++;
+                            auto cons = range.second[i];
+                            int ql = storage->mapped_queryrange[domain][i].first;
+                            int qr = storage->mapped_queryrange[domain][i].second;
+
+                            timeval t1, t2;
+                            gettimeofday(&t1, NULL);
+                            int filtered_num = tree->range_filter(ql, qr, filterednodes.data());
+                            auto res = TopDown_search(storage->query_points[i].data(), ef, storage->query_K, ql, qr, edge_limit, cons.attr_constraints, filterednodes.data(), filtered_num, use_heap);
+                            gettimeofday(&t2, NULL);
+                            searchtime += GetTime(t1, t2);
+
+                            std::map<int, int> record;
+                            while (res.size())
+                            {
+                                auto x = res.top().second;
+                                res.pop();
+                                if (record.count(x))
+                                    throw Exception("repetitive search results");
+                                record[x] = 1;
+                                if (std::find(gt[i].begin(), gt[i].end(), x) != gt[i].end())
+                                    tp++;
+                            }
                         }
-                    }
 
-                    float recall = 1.0 * tp / storage->query_nb / storage->query_K;
-                    float qps = storage->query_nb / searchtime;
-                    float dco = metric_distance_computations * 1.0 / storage->query_nb;
-                    float hop = metric_hops * 1.0 / storage->query_nb;
+                        float recall = 1.0 * tp / storage->query_nb / storage->query_K;
+                        float qps = storage->query_nb / searchtime;
+                        float dco = metric_distance_computations * 1.0 / storage->query_nb;
+                        float hop = metric_hops * 1.0 / storage->query_nb;
 
-                    HOP.emplace_back(hop);
-                    DCO.emplace_back(dco);
-                    QPS.emplace_back(qps);
-                    RECALL.emplace_back(recall);
+                        if (use_heap)
+                        {
+                            HEAP_QPS.emplace_back(qps);
+                            HEAP_RECALL.emplace_back(recall);
+                            continue;
+                        }
+                        HOP.emplace_back(hop);
+                        DCO.emplace_back(dco);
+                        QPS.emplace_back(qps);
+                        RECALL.emplace_back(recall);
+                    }
                 }
 
-                for (int i = 0; i < RECALL.size(); i++)
+                for (size_t i = 0; i < RECALL.size(); i++)
                 {
-                    outfile << SearchEF[i] << "," << RECALL[i] << "," << QPS[i] << "," << DCO[i] << "," << HOP[i] << std::endl;
+                    outfile << SearchEF[i] << "," << RECALL[i] << "," << QPS[i] << "," << DCO[i] << "," << HOP[i] << "," << HEAP_RECALL[i] << "," << HEAP_QPS[i] << std::endl;
                 }
                 outfile.close();
             }
@@ -0,0 +1,756 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+#include <fcntl.h>
+#include <unistd.h>
+#include "utils.h"
+#include "attribute.h"
+#include "scheduler.hpp"
+
+namespace iRangeGraph
+{
+    // Layout of an index file (version 4), a single self-describing container:
+    //   IndexHeader | SectionEntry[2 + layer_num (+ 1)] | sections
+    // Section 0 holds the tree metadata, section 1 the data vectors (nb * dim elements) and section 2 + l the
+    // lists of layer l, as nb fixed-size records of (1 + M) ints: the list size followed by M neighbor slots.
+    // Layer sections are stored in the order the layers were finished; a layer without any edges has no section
+    // (offset 0). The last layer holds the leaves of the tree, which never have a graph. An index built with
+    // attribute values has one more section, 2 + layer_num, with the nb int64 keys of the values in ascending
+    // order (see AttributeColumn); header.attribute_type says how they map to values. Every section carries a
+    // CRC-32C of its bytes.
+    constexpr uint32_t kIndexMagic = 0x47526969; // "iiRG"
+    constexpr uint32_t kIndexVersion = 4;
+    constexpr uint32_t kMetricL2 = 0;
+    constexpr uint32_t kElementFloat32 = 0;
+
+    struct IndexHeader
+    {
+        uint32_t magic{kIndexMagic};
+        uint32_t version{kIndexVersion};
+        uint32_t nb{0};
+        uint32_t dim{0};
+        uint32_t M{0};
+        uint32_t fanout{2};
+        uint32_t leaf_size{1};
+        uint32_t layer_num{0};
+        uint32_t metric{kMetricL2};
+        uint32_t element_type{kElementFloat32};
+        uint32_t section_num{0};
+        uint32_t attribute_type{kAttributeNone};
+    };
+
+    enum SectionKind : uint32_t
+    {
+        kSectionNone = 0,
+        kSectionTree = 1,
+        kSectionVectors = 2,
+        kSectionLinks = 3,
+        kSectionAttributes = 4,
+    };
+
+    struct SectionEntry
+    {
+        uint32_t kind{kSectionNone};
+        uint32_t layer{0};
+        uint64_t offset{0};
+        uint64_t bytes{0};
+        uint32_t checksum{0};
+        uint32_t reserved{0};
+    };
+
+    struct TreeMeta
+    {
+        uint64_t root_span{0};
+        uint32_t height{0};
+        uint32_t node_num{0};
+    };
+
+    // CRC-32C; calls can be chained over consecutive blocks, starting from 0.
+    inline uint32_t Crc32c(uint32_t crc, const void *data, size_t bytes)
+    {
+        const uint8_t *p = (const uint8_t *)data;
+        crc = ~crc;
+#if defined(__SSE4_2__)
+        for (; bytes >= 8; bytes -= 8, p += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, p, sizeof(word));
+            crc = (uint32_t)_mm_crc32_u64(crc, word);
+        }
+        for (; bytes > 0; bytes--, p++)
+            crc = _mm_crc32_u8(crc, *p);
+#else
+        for (; bytes > 0; bytes--, p++)
+        {
+            crc ^= *p;
+            for (int k = 0; k < 8; k++)
+                crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+        }
+#endif
+        return ~crc;
+    }
+
+    // CRC-32C of A followed by B, from the CRCs of A and B and the length of B (zlib's crc32_combine).
+    inline uint32_t Crc32cCombine(uint32_t crc_a, uint32_t crc_b, uint64_t bytes_b)
+    {
+        auto times = [](const uint32_t *matrix, uint32_t vec)
+        {
+            uint32_t sum = 0;
+            for (; vec; vec >>= 1, matrix++)
+            {
+                if (vec & 1)
+                    sum ^= *matrix;
+            }
+            return sum;
+        };
+        auto square = [&](uint32_t *result, const uint32_t *matrix)
+        {
+            for (int n = 0; n < 32; n++)
+                result[n] = times(matrix, matrix[n]);
+        };
+        if (bytes_b == 0)
+            return crc_a;
+
+        // operator for one zero bit, then for two and four
+        uint32_t even[32], odd[32];
+        odd[0] = 0x82F63B78;
+        for (int n = 1; n < 32; n++)
+            odd[n] = 1u << (n - 1);
+        square(even, odd);
+        square(odd, even);
+        // apply len(B) zero bytes to crc_a
+        do
+        {
+            square(even, odd);
+            if (bytes_b & 1)
+                crc_a = times(even, crc_a);
+            bytes_b >>= 1;
+            if (bytes_b == 0)
+                break;
+            square(odd, even);
+            if (bytes_b & 1)
+                crc_a = times(odd, crc_a);
+            bytes_b >>= 1;
+        } while (bytes_b);
+        return crc_a ^ crc_b;
+    }
+
+    // A search image holds the memory of a loaded iRangeGraph_Search byte for byte, so it can be mapped instead
+    // of loaded: SearchImageHeader, then data_memory_ at data_offset, links_memory_ at links_offset and the
+    // attribute keys, if any, at attributes_offset.
+    constexpr uint32_t kImageMagic = 0x49475269; // "iRGI"
+    constexpr uint32_t kImageVersion = 2;
+    constexpr size_t kImageAlignment = 1 << 21;
+
+    struct SearchImageHeader
+    {
+        uint32_t magic{kImageMagic};
+        uint32_t version{kImageVersion};
+        uint32_t nb{0};
+        uint32_t dim{0};
+        uint32_t M{0};
+        uint32_t fanout{2};
+        uint32_t leaf_size{1};
+        uint32_t attribute_type{kAttributeNone};
+        uint64_t size_data_per_element{0};
+        uint64_t data_offset{0};
+        uint64_t data_bytes{0};
+        uint64_t links_offset{0};
+        uint64_t links_bytes{0};
+        uint64_t attributes_offset{0};
+        uint64_t attributes_bytes{0};
+    };
+
+    inline bool IsSearchImage(std::string path)
+    {
+        std::ifstream file(path, std::ios::in | std::ios::binary);
+        uint32_t magic = 0;
+        file.read((char *)&magic, sizeof(magic));
+        return file.good() && magic == kImageMagic;
+    }
+
+    // Where a search image shared under this name lives: a bare name is a POSIX shared memory object, anything
+    // with a '/' is taken as a path, e.g. on a hugetlbfs mount.
+    inline std::string SharedImagePath(std::string name)
+    {
+        if (name.find('/') != std::string::npos)
+            return name;
+        return "/dev/shm/" + name;
+    }
+
+    // A disk index keeps everything but the compressed vectors on disk for iRangeGraph_DiskSearch:
+    // DiskIndexHeader, the scalar quantizer (dim minimums, then dim step sizes), one uint8 code per dimension
+    // and point at codes_offset, and the node blocks from nodes_offset on. A node block holds the point's vector
+    // followed by its list at every graph layer, (1 + M) entries each at the layer's id width. Small blocks are
+    // packed nodes_per_sector to a sector; larger ones take sectors_per_node whole sectors. The header, the
+    // quantizer and the codes carry CRC-32Cs; header_checksum is taken with the field itself set to 0.
+    constexpr uint32_t kDiskMagic = 0x4B534469; // "iDSK"
+    constexpr uint32_t kDiskVersion = 2;
+
+    struct DiskIndexHeader
+    {
+        uint32_t magic{kDiskMagic};
+        uint32_t version{kDiskVersion};
+        uint32_t nb{0};
+        uint32_t dim{0};
+        uint32_t M{0};
+        uint32_t fanout{2};
+        uint32_t leaf_size{1};
+        uint32_t layer_num{0};
+        uint32_t node_bytes{0};
+        uint32_t nodes_per_sector{0};
+        uint32_t sectors_per_node{0};
+        uint32_t codes_checksum{0};
+        uint64_t codes_offset{0};
+        uint64_t nodes_offset{0};
+        uint32_t quantizer_checksum{0};
+        uint32_t header_checksum{0};
+    };
+
+    inline uint32_t DiskHeaderChecksum(DiskIndexHeader header)
+    {
+        header.header_checksum = 0;
+        return Crc32c(0, &header, sizeof(header));
+    }
+
+    // Writes an index file. The tree metadata is written up front; the vectors and the lists as they are handed
+    // over, together with the memory that owns them, by a background thread in large blocks, after which that
+    // memory is released. Lists come in runs of consecutive points in any order: a layer section is reserved in
+    // full when its first run arrives, each run is written at its place, and the checksums of the runs are
+    // combined once all are in.
+    class IndexWriter
+    {
+    public:
+        static constexpr size_t buffer_bytes = 64 << 20;
+
+        // With an attribute_type, the attribute keys have to be handed over through push_attributes.
+        // At most max_pending jobs wait for the writer; pushing more blocks until it catches up, so a build that
+        // outruns the disk does not keep every released chunk alive.
+        IndexWriter(std::string path, const SegmentTree &tree, uint32_t nb, uint32_t dim, uint32_t M,
+                    AttributeType attribute_type = kAttributeNone, size_t max_pending = 16) : indexpath(path), max_pending_(max_pending)
+        {
+            if (max_pending_ == 0)
+                throw Exception("the writer should accept at least one pending job");
+            header.nb = nb;
+            header.dim = dim;
+            header.M = M;
+            header.fanout = tree.ways_;
+            header.leaf_size = tree.leaf_size_;
+            header.layer_num = tree.max_depth + 1;
+            header.attribute_type = attribute_type;
+            header.section_num = 2 + header.layer_num + (attribute_type != kAttributeNone);
+            sections.assign(header.section_num, SectionEntry());
+            runs.resize(header.layer_num);
+
+            CheckPath(indexpath);
+            indexfile.open(indexpath, std::ios::out | std::ios::binary);
+            if (!indexfile.is_open())
+                throw Exception("cannot open " + indexpath);
+            write_table();
+
+            TreeMeta meta;
+            meta.root_span = tree.root_span;
+            meta.height = tree.height;
+            meta.node_num = tree.node_num();
+            SectionEntry &section = begin_section(0, kSectionTree, 0);
+            write_block(section, &meta, sizeof(meta));
+            end_section(section);
+
+            writer = std::thread(&IndexWriter::writer_loop, this);
+        }
+
+        ~IndexWriter()
+        {
+            if (writer.joinable())
+            {
+                stop();
+                writer.join();
+            }
+        }
+
+        // points must stay alive until finish()
+        void push_vectors(const std::vector<std::vector<float>> *points)
+        {
+            enqueue({-1, 0, 0, nullptr, nullptr, nullptr, 0, points, nullptr});
+        }
+
+        // keys must stay alive until finish()
+        void push_attributes(const std::vector<int64_t> *keys)
+        {
+            if (header.attribute_type == kAttributeNone)
+                throw Exception("the index was opened without an attribute type");
+            enqueue({-1, 0, 0, nullptr, nullptr, nullptr, 0, nullptr, keys});
+        }
+
+        // sizes[i] and ids[i * stride ...] describe the lists of the points first + i, for i < count, at this layer
+        void push(int layer, size_t first, size_t count, std::shared_ptr<void> owner, const int *sizes, const int *ids, size_t stride)
+        {
+            if (layer < 0 || layer >= (int)header.layer_num)
+                throw Exception("layer out of range");
+            if (first + count > header.nb)
+                throw Exception("lists past the last point");
+            enqueue({layer, first, count, std::move(owner), sizes, ids, stride, nullptr, nullptr});
+        }
+
+        void finish()
+        {
+            stop();
+            writer.join();
+            if (!error.empty())
+                throw Exception(error);
+            for (int layer = 0; layer < (int)header.layer_num; layer++)
+                close_layer(layer);
+            if (sections[1].kind != kSectionVectors)
+                throw Exception("the vectors of " + indexpath + " were not written");
+            if (header.attribute_type != kAttributeNone && sections[2 + header.layer_num].kind != kSectionAttributes)
+                throw Exception("the attributes of " + indexpath + " were not written");
+            indexfile.seekp(0);
+            write_table();
+            indexfile.close();
+            if (indexfile.fail())
+                throw Exception("failed to write " + indexpath);
+        }
+
+    private:
+        struct Job
+        {
+            int layer;
+            size_t first;
+            size_t count;
+            std::shared_ptr<void> owner;
+            const int *sizes;
+            const int *ids;
+            size_t stride;
+            const std::vector<std::vector<float>> *points;
+            const std::vector<int64_t> *keys;
+        };
+
+        std::string indexpath;
+        std::ofstream indexfile;
+        IndexHeader header;
+        std::vector<SectionEntry> sections;
+
+        std::thread writer;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+        std::condition_variable space_cv;
+        std::deque<Job> jobs;
+        size_t max_pending_;
+        bool stopping{false};
+        std::string error;
+        // the end of the sections placed so far
+        uint64_t end_offset{0};
+        // for each layer, the first point, point count and checksum of every run written
+        std::vector<std::vector<std::tuple<size_t, size_t, uint32_t>>> runs;
+
+        void enqueue(Job job)
+        {
+            {
+                std::unique_lock<std::mutex> lock(queue_mutex);
+                space_cv.wait(lock, [this]
+                              { return jobs.size() < max_pending_; });
+                jobs.push_back(std::move(job));
+            }
+            queue_cv.notify_one();
+        }
+
+        void stop()
+        {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                stopping = true;
+            }
+            queue_cv.notify_one();
+        }
+
+        void write_table()
+        {
+            indexfile.write((char *)&header, sizeof(IndexHeader));
+            indexfile.write((char *)sections.data(), sections.size() * sizeof(SectionEntry));
+        }
+
+        // Places a section after the ones placed so far; bytes is its size when known up front.
+        SectionEntry &begin_section(int index, SectionKind kind, int layer, uint64_t bytes = 0)
+        {
+            if (end_offset == 0)
+                end_offset = indexfile.tellp();
+            SectionEntry &section = sections[index];
+            section.kind = kind;
+            section.layer = layer;
+            section.offset = end_offset;
+            section.bytes = 0;
+            section.checksum = 0;
+            indexfile.seekp(section.offset);
+            end_offset += bytes;
+            return section;
+        }
+
+        void end_section(SectionEntry &section)
+        {
+            end_offset = std::max(end_offset, section.offset + section.bytes);
+        }
+
+        void write_block(SectionEntry &section, const void *data, size_t bytes)
+        {
+            indexfile.write((const char *)data, bytes);
+            section.checksum = Crc32c(section.checksum, data, bytes);
+            section.bytes += bytes;
+        }
+
+        void write_vectors(Job &job)
+        {
+            const auto &points = *job.points;
+            size_t dim = header.dim;
+            size_t batch = std::max<size_t>(1, buffer_bytes / (dim * sizeof(float)));
+            std::vector<float> buffer(std::min<size_t>(batch, header.nb) * dim);
+            SectionEntry &section = begin_section(1, kSectionVectors, 0);
+            for (size_t begin = 0; begin < header.nb; begin += batch)
+            {
+                size_t end = std::min<size_t>(header.nb, begin + batch);
+                for (size_t pid = begin; pid < end; pid++)
+                {
+                    if (points[pid].size() != dim)
+                        throw Exception("data point " + std::to_string(pid) + " does not have " + std::to_string(dim) + " dimensions");
+                    std::memcpy(buffer.data() + (pid - begin) * dim, points[pid].data(), dim * sizeof(float));
+                }
+                write_block(section, buffer.data(), (end - begin) * dim * sizeof(float));
+            }
+            end_section(section);
+            if (indexfile.fail())
+                throw Exception("failed to write " + indexpath);
+        }
+
+        void write_attributes(Job &job)
+        {
+            if (job.keys->size() != header.nb)
+                throw Exception("there should be one attribute value per point");
+            SectionEntry &section = begin_section(2 + header.layer_num, kSectionAttributes, 0);
+            write_block(section, job.keys->data(), header.nb * sizeof(int64_t));
+            end_section(section);
+            if (indexfile.fail())
+                throw Exception("failed to write " + indexpath);
+        }
+
+        size_t record_bytes() const { return (header.M + 1) * sizeof(int); }
+
+        void write_layer(Job &job)
+        {
+            size_t M = header.M;
+            size_t record_ints = M + 1;
+            size_t batch = std::max<size_t>(1, buffer_bytes / (record_ints * sizeof(int)));
+            std::vector<int> buffer(std::min<size_t>(batch, job.count) * record_ints);
+
+            SectionEntry &section = sections[2 + job.layer];
+            if (section.kind != kSectionLinks)
+                begin_section(2 + job.layer, kSectionLinks, job.layer, header.nb * record_bytes());
+            indexfile.seekp(section.offset + job.first * record_bytes());
+            uint32_t checksum = 0;
+            for (size_t begin = 0; begin < job.count; begin += batch)
+            {
+                size_t end = std::min<size_t>(job.count, begin + batch);
+                std::fill(buffer.begin(), buffer.end(), 0);
+                for (size_t i = begin; i < end; i++)
+                {
+                    int *record = buffer.data() + (i - begin) * record_ints;
+                    int size = job.sizes[i];
+                    if ((size_t)size > M)
+                        throw Exception("real linklist size is bigger than defined M");
+                    record[0] = size;
+                    std::memcpy(record + 1, job.ids + i * job.stride, size * sizeof(int));
+                }
+                size_t bytes = (end - begin) * record_bytes();
+                indexfile.write((const char *)buffer.data(), bytes);
+                checksum = Crc32c(checksum, buffer.data(), bytes);
+            }
+            runs[job.layer].emplace_back(job.first, job.count, checksum);
+            if (indexfile.fail())
+                throw Exception("failed to write " + indexpath);
+        }
+
+        // Chains the checksums of the runs of a layer in point order; points no run covered get empty lists.
+        void close_layer(int layer)
+        {
+            SectionEntry &section = sections[2 + layer];
+            if (section.kind != kSectionLinks)
+                return;
+            auto &layer_runs = runs[layer];
+            std::sort(layer_runs.begin(), layer_runs.end());
+            uint32_t checksum = 0;
+            size_t next = 0;
+            auto add_empty = [&](size_t count)
+            {
+                std::vector<char> zeros(std::min<size_t>(count * record_bytes(), buffer_bytes));
+                indexfile.seekp(section.offset + next * record_bytes());
+                for (size_t bytes = count * record_bytes(); bytes > 0;)
+                {
+                    size_t block = std::min(bytes, zeros.size());
+                    indexfile.write(zeros.data(), block);
+                    checksum = Crc32c(checksum, zeros.data(), block);
+                    bytes -= block;
+                }
+                next += count;
+            };
+            for (auto &run : layer_runs)
+            {
+                size_t first = std::get<0>(run), count = std::get<1>(run);
+                if (first < next)
+                    throw Exception("lists of layer " + std::to_string(layer) + " were written twice");
+                if (first > next)
+                    add_empty(first - next);
+                checksum = Crc32cCombine(checksum, std::get<2>(run), count * record_bytes());
+                next += count;
+            }
+            if (next < header.nb)
+                add_empty(header.nb - next);
+            section.bytes = header.nb * record_bytes();
+            section.checksum = checksum;
+            if (indexfile.fail())
+                throw Exception("failed to write " + indexpath);
+        }
+
+        void writer_loop()
+        {
+            while (true)
+            {
+                Job job;
+                {
+                    std::unique_lock<std::mutex> lock(queue_mutex);
+                    queue_cv.wait(lock, [this]
+                                  { return stopping || !jobs.empty(); });
+                    if (jobs.empty())
+                        return;
+                    job = std::move(jobs.front());
+                    jobs.pop_front();
+                }
+                space_cv.notify_one();
+                try
+                {
+                    if (!error.empty())
+                        continue;
+                    if (job.points != nullptr)
+                        write_vectors(job);
+                    else if (job.keys != nullptr)
+                        write_attributes(job);
+                    else
+                        write_layer(job);
+                }
+                catch (std::exception &e)
+                {
+                    error = e.what();
+                }
+            }
+        }
+    };
+
+    // Opens an index file and validates its header and section table against each other and against the file
+    // size before anything is allocated for it; sections are checked against their checksums as they are read.
+    // Sections are read by `threads` threads at once, each with pread on its own share of the fixed-size records.
+    class IndexReader
+    {
+    public:
+        static constexpr size_t buffer_bytes = 64 << 20;
+
+        IndexHeader header;
+        std::vector<SectionEntry> sections;
+        TreeMeta tree_meta;
+        size_t threads{std::max(1u, std::thread::hardware_concurrency())};
+
+        IndexReader(std::string path) : indexpath(path)
+        {
+            fd = open(indexpath.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw Exception("cannot open " + indexpath);
+            file_size = lseek(fd, 0, SEEK_END);
+
+            if (!read_at(&header, sizeof(IndexHeader), 0) || header.magic != kIndexMagic)
+                throw Exception(indexpath + " is not an iRangeGraph index file");
+            if (header.version != kIndexVersion)
+                throw Exception(indexpath + " has index version " + std::to_string(header.version) + ", this build reads version " +
+                                std::to_string(kIndexVersion) + "; rebuild the index");
+            if (header.metric != kMetricL2 || header.element_type != kElementFloat32)
+                throw Exception(indexpath + " uses an unsupported metric or element type");
+            if (header.nb == 0 || header.dim == 0 || header.M == 0 || header.fanout < 2 || header.leaf_size == 0)
+                throw Exception(indexpath + " has an invalid header");
+            SegmentTree tree(header.nb, header.fanout, header.leaf_size);
+            if (header.attribute_type > kAttributeFloat64 || header.layer_num != (uint32_t)tree.height + 1 ||
+                header.section_num != 2 + header.layer_num + (header.attribute_type != kAttributeNone))
+                throw Exception(indexpath + " has an invalid header");
+
+            sections.resize(header.section_num);
+            if (!read_at(sections.data(), sections.size() * sizeof(SectionEntry), sizeof(IndexHeader)))
+                throw Exception(indexpath + " is truncated");
+            check_section(0, kSectionTree, sizeof(TreeMeta));
+            check_section(1, kSectionVectors, (uint64_t)header.nb * header.dim * sizeof(float));
+            for (int layer = 0; layer < (int)header.layer_num; layer++)
+            {
+                if (sections[2 + layer].offset != 0)
+                    check_section(2 + layer, kSectionLinks, (uint64_t)header.nb * (header.M + 1) * sizeof(int));
+            }
+            if (header.attribute_type != kAttributeNone)
+                check_section(2 + header.layer_num, kSectionAttributes, (uint64_t)header.nb * sizeof(int64_t));
+
+            read_section(sections[0], sizeof(TreeMeta), [&](size_t, const char *record)
+                         { std::memcpy(&tree_meta, record, sizeof(TreeMeta)); });
+            if (tree_meta.root_span != (uint64_t)tree.root_span || tree_meta.height != (uint32_t)tree.height)
+                throw Exception(indexpath + " was built on a different tree");
+        }
+
+        ~IndexReader()
+        {
+            close(fd);
+        }
+
+        IndexReader(const IndexReader &) = delete;
+        IndexReader &operator=(const IndexReader &) = delete;
+
+        // Call once the tree is built.
+        void CheckTree(const SegmentTree &tree) const
+        {
+            if (tree_meta.node_num != tree.node_num())
+                throw Exception(indexpath + " was built on a tree of " + std::to_string(tree_meta.node_num) + " nodes, not " +
+                                std::to_string(tree.node_num()));
+        }
+
+        const SectionEntry &layer_section(int layer) const { return sections[2 + layer]; }
+
+        // Calls visitor(pid, vector) for the vector of every point; concurrently for different points.
+        void read_vectors(std::function<void(size_t, const float *)> visitor)
+        {
+            read_section(sections[1], header.dim * sizeof(float), [&](size_t pid, const char *record)
+                         { visitor(pid, (const float *)record); });
+        }
+
+        // Calls visitor(pid, record) for the (1 + M)-int record of every point at this layer, concurrently for
+        // different points. Returns false, without calling the visitor, for a layer that has no section.
+        bool read_layer(int layer, std::function<void(size_t, const int *)> visitor)
+        {
+            if (layer_section(layer).offset == 0)
+                return false;
+            read_section(layer_section(layer), (header.M + 1) * sizeof(int), [&](size_t pid, const char *record)
+                         {
+                             const int *list = (const int *)record;
+                             if (list[0] < 0 || list[0] > (int)header.M)
+                                 throw Exception("real linklist size is bigger than defined M_out");
+                             visitor(pid, list); });
+            return true;
+        }
+
+        // Reads the attribute keys, in the order of the points; returns false for an index without attributes.
+        bool read_attributes(std::vector<int64_t> &keys)
+        {
+            if (header.attribute_type == kAttributeNone)
+                return false;
+            keys.resize(header.nb);
+            read_section(sections[2 + header.layer_num], sizeof(int64_t), [&](size_t pid, const char *record)
+                         { std::memcpy(&keys[pid], record, sizeof(int64_t)); });
+            for (size_t pid = 1; pid < keys.size(); pid++)
+            {
+                if (keys[pid] < keys[pid - 1])
+                    throw Exception(indexpath + " has attribute values out of order");
+            }
+            return true;
+        }
+
+        // Copies the (1 + M)-int record of every point at every layer but the leaves to get_linklist(pid, layer).
+        void load_links(std::function<char *(int, int)> get_linklist)
+        {
+            for (int layer = 0; layer + 1 < (int)header.layer_num; layer++)
+            {
+                bool found = read_layer(layer, [&](size_t pid, const int *record)
+                                        { std::memcpy(get_linklist(pid, layer), record, (record[0] + 1) * sizeof(int)); });
+                if (!found)
+                {
+                    for (int pid = 0; pid < (int)header.nb; pid++)
+                        std::memset(get_linklist(pid, layer), 0, sizeof(int));
+                }
+            }
+        }
+
+    private:
+        std::string indexpath;
+        int fd{-1};
+        uint64_t file_size{0};
+
+        bool read_at(void *buffer, size_t bytes, uint64_t offset) const
+        {
+            char *dst = (char *)buffer;
+            while (bytes > 0)
+            {
+                ssize_t n = pread(fd, dst, bytes, offset);
+                if (n <= 0)
+                    return false;
+                dst += n;
+                bytes -= n;
+                offset += n;
+            }
+            return true;
+        }
+
+        void check_section(int index, SectionKind kind, uint64_t bytes)
+        {
+            const SectionEntry &section = sections[index];
+            if (section.kind != kind || section.bytes != bytes || section.offset < sizeof(IndexHeader) || section.offset + section.bytes > file_size)
+                throw Exception(indexpath + " has an invalid or truncated section " + std::to_string(index));
+        }
+
+        // Reads a section of fixed-size records and verifies its checksum. Every thread reads its contiguous share
+        // of the records in large blocks and checksums it; the shares' checksums are then combined in order.
+        void read_section(const SectionEntry &section, size_t record_bytes, std::function<void(size_t, const char *)> visitor)
+        {
+            size_t record_num = section.bytes / record_bytes;
+            size_t share_num = std::max<size_t>(1, std::min(threads, record_num));
+            size_t share = (record_num + share_num - 1) / share_num;
+            std::vector<uint32_t> checksums(share_num, 0);
+            std::vector<std::string> errors(share_num);
+            scheduler::parallel_chunks(0, share_num, share_num, [&](size_t first, size_t last)
+                                       {
+                                           for (size_t s = first; s < last; s++)
+                                           {
+                                               size_t lo = s * share, hi = std::min(record_num, lo + share);
+                                               size_t batch = std::max<size_t>(1, buffer_bytes / share_num / record_bytes);
+                                               std::vector<char> buffer(std::min(batch, hi - lo) * record_bytes);
+                                               try
+                                               {
+                                                   for (size_t begin = lo; begin < hi; begin += batch)
+                                                   {
+                                                       size_t end = std::min(hi, begin + batch);
+                                                       size_t bytes = (end - begin) * record_bytes;
+                                                       if (!read_at(buffer.data(), bytes, section.offset + begin * record_bytes))
+                                                           throw Exception(indexpath + " is truncated");
+                                                       checksums[s] = Crc32c(checksums[s], buffer.data(), bytes);
+                                                       for (size_t i = begin; i < end; i++)
+                                                           visitor(i, buffer.data() + (i - begin) * record_bytes);
+                                                   }
+                                               }
+                                               catch (std::exception &e)
+                                               {
+                                                   errors[s] = e.what();
+                                               }
+                                           } });
+            for (auto &error : errors)
+            {
+                if (!error.empty())
+                    throw Exception(error);
+            }
+
+            uint32_t checksum = 0;
+            for (size_t s = 0; s < share_num; s++)
+            {
+                size_t lo = s * share, hi = std::min(record_num, lo + share);
+                checksum = Crc32cCombine(checksum, checksums[s], (hi - lo) * record_bytes);
+            }
+            if (checksum != section.checksum)
+                throw Exception(indexpath + " is corrupted: checksum mismatch in the section at offset " + std::to_string(section.offset));
+        }
+    };
+}
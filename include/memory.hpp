@@ -17,6 +17,20 @@ namespace memory
         return p;
     }
 
+    // Zeroed memory in a mapping of its own, so freeing it hands the pages back to the system rather than to the
+    // allocator, whatever the order blocks are freed in.
+    inline void *map_zeroed(size_t nbytes)
+    {
+        void *p = mmap(nullptr, nbytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? nullptr : p;
+    }
+
+    inline void unmap(void *p, size_t nbytes)
+    {
+        if (p != nullptr)
+            munmap(p, nbytes);
+    }
+
 
     template <typename T>
     struct align_alloc
@@ -35,7 +49,7 @@ namespace memory
             madvise(ptr, sz, MADV_HUGEPAGE);
             return ptr;
         }
-        void deallocate(T *, int) { free(ptr); }
+        void deallocate(T *p, int) { free(p); }
         template <typename U>
         struct rebind
         {
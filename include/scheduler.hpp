@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace scheduler
+{
+    // Splits [begin, end) into one contiguous chunk per thread and runs func(lo, hi) on each, on short-lived
+    // threads; for one-off bulk work such as loading, where a persistent pool is not worth it.
+    template <typename Func>
+    void parallel_chunks(size_t begin, size_t end, size_t num_threads, Func func)
+    {
+        if (begin >= end)
+            return;
+        num_threads = std::max<size_t>(1, std::min(num_threads, end - begin));
+        size_t chunk = (end - begin + num_threads - 1) / num_threads;
+        std::vector<std::thread> threads;
+        for (size_t lo = begin + chunk; lo < end; lo += chunk)
+            threads.emplace_back(func, lo, std::min(end, lo + chunk));
+        func(begin, std::min(end, begin + chunk));
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    // Persistent pool of workers, each owning a deque of tasks. A worker pushes and pops at the back of its
+    // own deque (depth-first, cache friendly) and steals from the front of the others when it runs dry.
+    class WorkStealingPool
+    {
+    public:
+        using Task = std::function<void()>;
+
+        explicit WorkStealingPool(size_t num_threads) : queues_(num_threads == 0 ? 1 : num_threads)
+        {
+            for (size_t id = 0; id < queues_.size(); id++)
+                workers_.emplace_back(&WorkStealingPool::worker_loop, this, id);
+        }
+
+        ~WorkStealingPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(idle_mutex_);
+                stop_ = true;
+            }
+            work_cv_.notify_all();
+            for (auto &worker : workers_)
+            {
+                if (worker.joinable())
+                    worker.join();
+            }
+        }
+
+        size_t size() const { return queues_.size(); }
+
+        // Index of the calling worker, or -1 when called from outside the pool.
+        static int current_worker() { return worker_id(); }
+
+        // The calling thread's index among this pool's workers, or -1 when it is not one of them. Worker
+        // indices are per thread and shared by all pools, so code indexing per-worker state of one pool uses this.
+        int worker_index() const { return current_owner() == this ? current_worker() : -1; }
+
+        // Tasks submitted from a worker go to that worker's own deque; external submissions go to `hint`
+        // (or round-robin when hint is negative).
+        void submit(Task task, int hint = -1)
+        {
+            size_t id;
+            if (current_worker() >= 0 && current_owner() == this)
+                id = current_worker();
+            else if (hint >= 0)
+                id = hint % queues_.size();
+            else
+                id = next_queue_.fetch_add(1, std::memory_order_relaxed) % queues_.size();
+
+            pending_.fetch_add(1, std::memory_order_relaxed);
+            queued_.fetch_add(1, std::memory_order_release);
+            {
+                std::lock_guard<std::mutex> lock(queues_[id].mutex);
+                queues_[id].tasks.emplace_back(std::move(task));
+            }
+            {
+                // pairs with the predicate check in worker_loop so that a worker about to sleep cannot miss the task
+                std::lock_guard<std::mutex> lock(idle_mutex_);
+            }
+            work_cv_.notify_one();
+        }
+
+        // Splits [begin, end) into chunks of `grain` and runs func(lo, hi) on each of them. The caller keeps
+        // executing queued tasks while it waits, so a worker can fan out its own task without deadlocking.
+        template <typename Func>
+        void parallel_for(size_t begin, size_t end, size_t grain, Func func)
+        {
+            if (begin >= end)
+                return;
+            if (grain == 0)
+                grain = 1;
+            std::atomic<size_t> remaining((end - begin + grain - 1) / grain);
+            for (size_t lo = begin; lo < end; lo += grain)
+            {
+                size_t hi = std::min(end, lo + grain);
+                submit([&remaining, &func, lo, hi]
+                       {
+                           func(lo, hi);
+                           remaining.fetch_sub(1, std::memory_order_release); });
+            }
+            while (remaining.load(std::memory_order_acquire) > 0)
+            {
+                if (!run_one())
+                    std::this_thread::yield();
+            }
+        }
+
+        // Blocks until every submitted task, including tasks submitted by other tasks, has finished.
+        void wait_idle()
+        {
+            std::unique_lock<std::mutex> lock(idle_mutex_);
+            done_cv_.wait(lock, [this]
+                          { return pending_.load() == 0; });
+        }
+
+    private:
+        struct WorkQueue
+        {
+            std::mutex mutex;
+            std::deque<Task> tasks;
+        };
+
+        std::vector<WorkQueue> queues_;
+        std::vector<std::thread> workers_;
+        std::atomic<size_t> next_queue_{0};
+        std::atomic<size_t> pending_{0};
+
+        std::mutex idle_mutex_;
+        std::condition_variable work_cv_;
+        std::condition_variable done_cv_;
+        std::atomic<size_t> queued_{0};
+        bool stop_{false};
+
+        static int &worker_id()
+        {
+            static thread_local int id = -1;
+            return id;
+        }
+
+        static WorkStealingPool *&current_owner()
+        {
+            static thread_local WorkStealingPool *owner = nullptr;
+            return owner;
+        }
+
+        bool try_pop(size_t id, Task &task)
+        {
+            std::lock_guard<std::mutex> lock(queues_[id].mutex);
+            if (queues_[id].tasks.empty())
+                return false;
+            task = std::move(queues_[id].tasks.back());
+            queues_[id].tasks.pop_back();
+            return true;
+        }
+
+        bool try_steal(size_t id, Task &task)
+        {
+            for (size_t i = 1; i < queues_.size(); i++)
+            {
+                size_t victim = (id + i) % queues_.size();
+                std::lock_guard<std::mutex> lock(queues_[victim].mutex);
+                if (queues_[victim].tasks.empty())
+                    continue;
+                task = std::move(queues_[victim].tasks.front());
+                queues_[victim].tasks.pop_front();
+                return true;
+            }
+            return false;
+        }
+
+        void execute(Task &task)
+        {
+            queued_.fetch_sub(1, std::memory_order_relaxed);
+            task();
+            if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            {
+                std::lock_guard<std::mutex> lock(idle_mutex_);
+                done_cv_.notify_all();
+            }
+        }
+
+        // Runs one queued task on behalf of the caller, preferring the caller's own deque.
+        bool run_one()
+        {
+            Task task;
+            if (current_owner() == this && current_worker() >= 0)
+            {
+                size_t id = current_worker();
+                if (!try_pop(id, task) && !try_steal(id, task))
+                    return false;
+            }
+            else if (!try_steal(queues_.size() - 1, task) && !try_pop(queues_.size() - 1, task))
+                return false;
+            execute(task);
+            return true;
+        }
+
+        void worker_loop(size_t id)
+        {
+            worker_id() = id;
+            current_owner() = this;
+            while (true)
+            {
+                Task task;
+                if (try_pop(id, task) || try_steal(id, task))
+                {
+                    execute(task);
+                    continue;
+                }
+                std::unique_lock<std::mutex> lock(idle_mutex_);
+                work_cv_.wait(lock, [this]
+                              { return stop_ || queued_.load(std::memory_order_acquire) > 0; });
+                if (stop_ && queued_.load() == 0)
+                    return;
+            }
+        }
+    };
+}
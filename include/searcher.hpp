@@ -1,6 +1,14 @@
 #pragma once 
 
 #include <vector>
+#include <deque>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <cstring>
 #include <stdint.h>
 #include <stdlib.h>
 #include "memory.hpp"
@@ -60,31 +68,67 @@ namespace searcher
     };
 
 
+    // Candidate pool of a graph search: a sorted array of at most capacity points, holding the limit closest points
+    // found so far that count as results, and the points closer than the farthest of them that are only routed
+    // through (deleted or out of the query range). Everything farther is rejected on insertion. pop() returns the
+    // closest point not expanded yet. The routing flag and the expanded flag are kept in the top bits of the id,
+    // so point ids have to be below 2^30; the constructor checks the number of points n against that.
     struct LinearPool
     {
     public:
         int nb, size_ = 0, cur_ = 0, capacity_;
+        int limit_, counted_ = 0;
         std::vector<Candidiate<float>,memory::align_alloc<Candidiate<float>>> data_;
-        Bitset<uint64_t> vis;
-        constexpr static int kMask = 2147483647;
+        constexpr static int kMask = (1 << 30) - 1;
+        constexpr static int kRouting = 1 << 30;
 
-        LinearPool(int n, int capacity)
-            : nb(n), capacity_(capacity), data_(capacity_ + 1), vis(n) {}
+        LinearPool(size_t n, int capacity)
+            : nb(CheckPoints(n)), capacity_(capacity), limit_(capacity), data_(capacity_ + 1) {}
 
-        bool insert(int u, float dist)
+        static int CheckPoints(size_t n)
         {
-            if (size_ == capacity_ && dist >= data_[size_ - 1].distance)
+            if (n > (size_t)kRouting)
+                throw std::length_error("the candidate pool takes at most 2^30 points, " + std::to_string(n) + " are given");
+            return n;
+        }
+
+        // Empties the pool for another search, keeping its memory when it is large enough.
+        void reset(int limit, int capacity)
+        {
+            if (data_.size() < (size_t)capacity + 1)
+                data_.resize(capacity + 1);
+            capacity_ = capacity;
+            limit_ = limit;
+            size_ = cur_ = counted_ = 0;
+        }
+
+        bool insert(int u, float dist, bool routing = false)
+        {
+            if (size_ > 0 && dist >= data_[size_ - 1].distance && (size_ == capacity_ || counted_ == limit_))
             {
                 return false;
             }
             int lo = find_bsearch(dist);
             std::memmove(&data_[lo + 1], &data_[lo],
                          (size_ - lo) * sizeof(Candidiate<float>));
-            data_[lo] = {u, dist};
+            data_[lo] = {routing ? u | kRouting : u, dist};
             if (size_ < capacity_)
             {
                 ++size_;
             }
+            else if (!is_routing(data_[size_].id))
+            {
+                --counted_;
+            }
+            if (!routing && ++counted_ > limit_)
+            {
+                // drop the farthest result and the routing points behind the one before it
+                while (is_routing(data_[--size_].id))
+                    ;
+                --counted_;
+                while (size_ > 0 && is_routing(data_[size_ - 1].id))
+                    --size_;
+            }
             if (lo < cur_)
             {
                 cur_ = lo;
@@ -108,6 +152,18 @@ namespace searcher
         int get_size() const { return size_; }
 
         int id(int i) const { return get_id(data_[i].id); }
+
+        // Appends the k closest results to out.
+        void results(int k, std::vector<std::pair<float, int>> &out) const
+        {
+            for (int i = 0; i < size_ && k > 0; i++)
+            {
+                if (is_routing(data_[i].id))
+                    continue;
+                out.emplace_back(data_[i].distance, id(i));
+                k--;
+            }
+        }
         
     private:
         int find_bsearch(float dist)
@@ -131,5 +187,152 @@ namespace searcher
         int get_id(int id) const { return id & kMask; }
         void set_checked(int &id) { id |= 1 << 31; }
         int is_checked(int id) { return id >> 31 & 1; }
+        static bool is_routing(int id) { return id & kRouting; }
+    };
+
+    // The same interface over a min-heap of points to expand and a max-heap of at most limit results, as the
+    // searches used before LinearPool; kept to compare the two.
+    struct HeapPool
+    {
+        typedef std::pair<float, int> PFI;
+        std::vector<PFI> candidates;
+        std::vector<PFI> top;
+        int limit_{0};
+
+        void reset(int limit)
+        {
+            candidates.clear();
+            top.clear();
+            limit_ = limit;
+        }
+
+        bool insert(int u, float dist, bool routing = false)
+        {
+            if (top.size() >= (size_t)limit_ && dist >= top.front().first)
+                return false;
+            candidates.emplace_back(dist, u);
+            std::push_heap(candidates.begin(), candidates.end(), std::greater<PFI>());
+            if (routing)
+                return true;
+            top.emplace_back(dist, u);
+            std::push_heap(top.begin(), top.end());
+            if (top.size() > (size_t)limit_)
+            {
+                std::pop_heap(top.begin(), top.end());
+                top.pop_back();
+            }
+            return true;
+        }
+
+        bool has_next() const
+        {
+            return !candidates.empty() && (top.empty() || candidates.front().first <= top.front().first);
+        }
+
+        int pop()
+        {
+            std::pop_heap(candidates.begin(), candidates.end(), std::greater<PFI>());
+            int u = candidates.back().second;
+            candidates.pop_back();
+            return u;
+        }
+
+        void results(int k, std::vector<PFI> &out)
+        {
+            while (top.size() > (size_t)k)
+            {
+                std::pop_heap(top.begin(), top.end());
+                top.pop_back();
+            }
+            out.insert(out.end(), top.begin(), top.end());
+        }
+    };
+
+    // Scratch state of one query, reused from query to query: visited marks over the query window, tagged with an
+    // epoch so that starting a query clears nothing, the candidate pool and the edges selected at a hop.
+    struct SearchContext
+    {
+        typedef unsigned short vl_type;
+        std::vector<vl_type> visited;
+        vl_type epoch{0};
+        int offset{0};
+        // candidate pools, the heaps only for comparison, and the results of the last query
+        LinearPool pool;
+        HeapPool heap;
+        std::vector<std::pair<float, int>> top;
+        // room for every neighbor a single hop can select
+        std::vector<int> edges;
+        // work done since the counters were last merged into the index's metrics
+        size_t distance_computations{0};
+        size_t hops{0};
+
+        // points is the size of the index searched, at most 2^30
+        SearchContext(size_t edge_capacity, size_t points) : pool(points, 0), edges(edge_capacity) {}
+
+        // Starts a query over [ql, qr]; the marks are only cleared when the window grows or the epoch wraps around.
+        void begin(int ql, int qr)
+        {
+            offset = ql;
+            size_t range_size = qr - ql + 1;
+            if (visited.size() < range_size)
+            {
+                visited.assign(range_size, 0);
+                epoch = 0;
+            }
+            if (++epoch == 0)
+            {
+                std::fill(visited.begin(), visited.end(), 0);
+                epoch = 1;
+            }
+            top.clear();
+        }
+
+        bool is_visited(int pid) const { return visited[pid - offset] == epoch; }
+        void set_visited(int pid) { visited[pid - offset] = epoch; }
+    };
+
+    // Hands out one context per concurrent query, in the manner of hnswlib::VisitedListPool.
+    class SearchContextPool
+    {
+        std::deque<SearchContext *> pool_;
+        std::mutex mutex_;
+        size_t edge_capacity_;
+        size_t points_;
+
+    public:
+        // Throws when the index has too many points for the candidate pool.
+        SearchContextPool(size_t edge_capacity, size_t points) : edge_capacity_(edge_capacity), points_(points)
+        {
+            pool_.push_back(new SearchContext(edge_capacity_, points_));
+        }
+
+        SearchContextPool(const SearchContextPool &) = delete;
+        SearchContextPool &operator=(const SearchContextPool &) = delete;
+
+        ~SearchContextPool()
+        {
+            for (auto ctx : pool_)
+                delete ctx;
+        }
+
+        SearchContext *get()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (!pool_.empty())
+                {
+                    SearchContext *ctx = pool_.front();
+                    pool_.pop_front();
+                    return ctx;
+                }
+            }
+            return new SearchContext(edge_capacity_, points_);
+        }
+
+        void release(SearchContext *ctx)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            pool_.push_front(ctx);
+        }
     };
 }
\ No newline at end of file
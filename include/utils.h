@@ -263,77 +263,199 @@ namespace iRangeGraph
         }
     };
 
-    class TreeNode
+    // A node of SegmentTree, computed on demand: the index-th node at its depth, covering [lbound, rbound].
+    struct TreeNode
     {
-    public:
-        int node_id;
-        int lbound, rbound;
-        int depth;
-        std::vector<TreeNode *> childs;
-        TreeNode(int l, int r, int d) : lbound(l), rbound(r), depth(d) {}
+        int lbound{0}, rbound{-1};
+        int depth{0};
+        long long index{0};
     };
 
+    // Node boundaries are aligned to powers of ways_ and clipped to the data size: the root covers the smallest
+    // power of ways_ that holds all points and every node splits into ways_ equal spans. Appending points at the
+    // right end therefore leaves every node that does not reach past the old last point unchanged.
+    // Nodes spanning at most leaf_size_ points are leaves (buckets): they carry no graph and are scanned instead.
+    // The tree is implicit: the index-th node at depth d covers [index * span(d), (index + 1) * span(d) - 1]
+    // clipped to the points, so nothing is allocated per node.
     class SegmentTree
     {
     public:
-        int ways_ = 2;
-        TreeNode *root{nullptr};
-        int max_depth{-1};
-        std::vector<TreeNode *> treenodes;
+        int ways_;
+        int leaf_size_;
+        int data_nb_;
+        long long root_span{1};
+        // depth of the leaves
+        int height{0};
+        int max_depth{0};
 
-        SegmentTree(int data_nb)
+        SegmentTree(int data_nb, int ways = 2, int leaf_size = 1) : ways_(ways), leaf_size_(leaf_size), data_nb_(data_nb)
         {
-            root = new TreeNode(0, data_nb - 1, 0);
+            if (ways_ < 2)
+                throw Exception("fan-out should be at least 2");
+            if (leaf_size_ < 1)
+                throw Exception("leaf size should be a positive integer");
+            while (root_span < data_nb)
+                root_span *= ways_;
+            span_.emplace_back(root_span);
+            while (span_.back() > leaf_size_)
+                span_.emplace_back(span_.back() / ways_);
+            height = max_depth = span_.size() - 1;
+            if ((ways_ & (ways_ - 1)) == 0)
+            {
+                for (auto span : span_)
+                    shift_.emplace_back(__builtin_ctzll(span));
+            }
+            level_offset_.emplace_back(0);
+            for (int depth = 0; depth <= max_depth; depth++)
+                level_offset_.emplace_back(level_offset_.back() + level_size(depth));
         }
 
-        void BuildTree(TreeNode *u)
+        long long node_span(int depth) const { return span_[depth]; }
+
+        // lbound of the node at a depth that holds pid; a shift when the fan-out is a power of two
+        inline long long node_lbound(long long pid, int depth) const
         {
-            if (u == nullptr)
-                throw Exception("Tree node is a nullptr");
-            treenodes.emplace_back(u);
-            max_depth = std::max(max_depth, u->depth);
-            int L = u->lbound, R = u->rbound;
-            size_t Len = R - L + 1;
-            if (L == R)
-                return;
-            int gap = (R - L + 1) / ways_;
-            int res = (R - L + 1) % ways_;
+            if (!shift_.empty())
+                return pid >> shift_[depth] << shift_[depth];
+            return pid / span_[depth] * span_[depth];
+        }
+
+        // The deepest depth whose node holds both ql and qr. With a power-of-two fan-out it follows from the
+        // highest bit in which ql and qr differ.
+        int lca_depth(int ql, int qr) const
+        {
+            if (ql == qr)
+                return max_depth;
+            if (!shift_.empty())
+            {
+                int bit = 63 - __builtin_clzll((unsigned long long)(ql ^ qr));
+                // shift_[depth] = shift_[0] - depth * log2(ways_) has to exceed bit
+                return std::min(max_depth, (shift_[0] - bit - 1) / __builtin_ctz(ways_));
+            }
+            int depth = max_depth;
+            while (ql / span_[depth] != qr / span_[depth])
+                depth--;
+            return depth;
+        }
+
+        // number of nodes at a depth
+        long long level_size(int depth) const { return (data_nb_ + span_[depth] - 1) / span_[depth]; }
+
+        size_t node_num() const { return level_offset_.back(); }
+
+        // Dense id of a node, level by level from the root.
+        size_t node_id(const TreeNode &u) const { return level_offset_[u.depth] + u.index; }
+
+        TreeNode node(int depth, long long index) const
+        {
+            TreeNode u;
+            u.depth = depth;
+            u.index = index;
+            u.lbound = index * span_[depth];
+            u.rbound = std::min<long long>(u.lbound + span_[depth], data_nb_) - 1;
+            return u;
+        }
+
+        TreeNode root() const { return node(0, 0); }
 
-            for (int l = L; l <= R;)
+        // The node at a depth that holds pid.
+        TreeNode node_of(int pid, int depth) const { return node(depth, pid / span_[depth]); }
+
+        bool is_leaf(const TreeNode &u) const { return u.depth == max_depth; }
+
+        int child_num(const TreeNode &u) const
+        {
+            if (is_leaf(u))
+                return 0;
+            return (u.rbound - u.lbound) / span_[u.depth + 1] + 1;
+        }
+
+        TreeNode child(const TreeNode &u, int i) const { return node(u.depth + 1, u.index * ways_ + i); }
+
+        TreeNode parent(const TreeNode &u) const { return node(u.depth - 1, u.index / ways_); }
+
+        // Calls visit(depth, lbound) for each layer whose node around pid holds points of [ql, qr] that the child
+        // around pid does not, i.e. each layer whose list can lead somewhere new, from top_depth down to the first
+        // node inside the range; stops early once visit returns true. Above top_depth = lca_depth(ql, qr) every node
+        // around pid holds the whole range, and so does its child. pid has to lie in [ql, qr].
+        template <typename Visit>
+        void for_each_split_layer(int pid, int ql, int qr, int top_depth, Visit visit) const
+        {
+            long long lbound = node_lbound(pid, top_depth);
+            long long overlap = qr - ql + 1;
+            for (int depth = top_depth; depth < max_depth; depth++)
             {
-                int r = l + gap - 1;
-                if (res > 0)
+                long long child_lbound = node_lbound(pid, depth + 1);
+                long long child_rbound = std::min<long long>(child_lbound + span_[depth + 1], data_nb_) - 1;
+                long long child_overlap = std::min<long long>(child_rbound, qr) - std::max<long long>(child_lbound, ql) + 1;
+                if (child_overlap != overlap)
                 {
-                    r++;
-                    res--;
+                    if (visit(depth, (int)lbound))
+                        return;
+                    if (lbound >= ql && std::min<long long>(lbound + span_[depth], data_nb_) - 1 <= qr)
+                        return;
                 }
-                r = std::min(r, R);
-                TreeNode *childnode = new TreeNode(l, r, u->depth + 1);
-                u->childs.emplace_back(childnode);
-                BuildTree(childnode);
-                l = r + 1;
+                lbound = child_lbound;
+                overlap = child_overlap;
             }
         }
 
-        std::vector<TreeNode *> range_filter(TreeNode *u, int ql, int qr)
+        // Upper bound on the nodes range_filter returns: at most ways_ - 1 on each side of the range per depth.
+        int max_filtered_nodes() const { return 2 * (ways_ - 1) * max_depth + 1; }
+
+        // Writes the nodes inside [ql, qr] whose parent is not inside it to nodes, which has room for
+        // max_filtered_nodes(), and returns their number. Leaves only partly inside are left out. The nodes are
+        // peeled off both ends of the range, deepest first, so no allocation or recursion is needed.
+        int range_filter(int ql, int qr, TreeNode *nodes) const
         {
-            if (u->lbound >= ql && u->rbound <= qr)
-                return {u};
-            std::vector<TreeNode *> res;
-            if (u->lbound > qr)
-                return res;
-            if (u->rbound < ql)
-                return res;
-            for (auto child : u->childs)
+            int num = 0;
+            long long leaf_span = span_[max_depth];
+            long long lo = (ql + leaf_span - 1) / leaf_span * leaf_span;
+            // nodes past the last point do not exist, so a range reaching it extends to the end of the root
+            long long hi = qr + 1 >= data_nb_ ? root_span : (qr + 1) / leaf_span * leaf_span;
+            for (int depth = max_depth; depth > 0 && lo < hi && lo < data_nb_; depth--)
             {
-                auto t = range_filter(child, ql, qr);
-                while (t.size())
+                long long span = span_[depth], parent_span = span_[depth - 1];
+                while (lo % parent_span != 0 && lo + span <= hi && lo < data_nb_)
                 {
-                    res.emplace_back(t.back());
-                    t.pop_back();
+                    nodes[num++] = node(depth, lo / span);
+                    lo += span;
+                }
+                while (hi % parent_span != 0 && hi - span >= lo)
+                {
+                    hi -= span;
+                    if (hi < data_nb_)
+                        nodes[num++] = node(depth, hi / span);
                 }
             }
-            return res;
+            if (lo < hi && lo < data_nb_)
+                nodes[num++] = root();
+            return num;
         }
+
+        // Leaves are scanned rather than entered: calls scan(l, r) for each filtered leaf, and for the leaves
+        // holding the two ends of [ql, qr] from the end inwards, which range_filter leaves out. Their points still
+        // seed the graph search above them. A range inside a single leaf has to be scanned by the caller.
+        template <typename Scan>
+        void for_each_scanned_leaf(int ql, int qr, const TreeNode *filterednodes, int filtered_num, Scan scan) const
+        {
+            for (int i = 0; i < filtered_num; i++)
+            {
+                if (is_leaf(filterednodes[i]))
+                    scan(filterednodes[i].lbound, filterednodes[i].rbound);
+            }
+            long long leaf_span = span_[max_depth];
+            if (leaf_span == 1)
+                return;
+            if (ql % leaf_span != 0)
+                scan(ql, node_lbound(ql, max_depth) + leaf_span - 1);
+            if ((qr + 1) % leaf_span != 0 && qr + 1 != data_nb_)
+                scan(node_lbound(qr, max_depth), qr);
+        }
+
+    private:
+        std::vector<long long> span_;
+        std::vector<int> shift_;
+        std::vector<long long> level_offset_;
     };
 }
\ No newline at end of file
@@ -5,6 +5,9 @@ std::unordered_map<std::string, std::string> paths;
 int M;
 int ef_construction;
 int threads;
+int fanout = 2;
+int leaf_size = 1;
+std::string attribute_type = "int64";
 
 int main(int argc, char **argv)
 {
@@ -21,6 +24,16 @@ int main(int argc, char **argv)
             ef_construction = std::stoi(argv[i + 1]);
         if (arg == "--threads")
             threads = std::stoi(argv[i + 1]);
+        if (arg == "--fanout")
+            fanout = std::stoi(argv[i + 1]);
+        if (arg == "--leaf_size")
+            leaf_size = std::stoi(argv[i + 1]);
+        if (arg == "--append_from")
+            paths["append_from"] = argv[i + 1];
+        if (arg == "--attribute_file")
+            paths["attribute"] = argv[i + 1];
+        if (arg == "--attribute_type")
+            attribute_type = argv[i + 1];
     }
 
     if (paths["data_vector"] == "")
@@ -33,10 +46,23 @@ int main(int argc, char **argv)
         throw Exception("ef_construction should be a positive integer");
     if (threads <= 0)
         throw Exception("threads should be a positive integer");
+    if (fanout < 2)
+        throw Exception("fanout should be an integer no less than 2");
+    if (leaf_size <= 0)
+        throw Exception("leaf_size should be a positive integer");
 
     iRangeGraph::DataLoader storage;
     storage.LoadData(paths["data_vector"]);
-    iRangeGraph::iRangeGraph_Build<float> index(&storage, M, ef_construction);
+    iRangeGraph::iRangeGraph_Build<float> index(&storage, M, ef_construction, fanout, leaf_size);
     index.max_threads = threads;
-    index.buildandsave(paths["index_save"]);
+    if (paths["attribute"] != "")
+    {
+        std::vector<int64_t> keys;
+        iRangeGraph::AttributeType type = iRangeGraph::LoadAttributeFile(paths["attribute"], attribute_type, storage.data_nb, keys);
+        index.SetAttributes(type, std::move(keys));
+    }
+    if (paths["append_from"] == "")
+        index.buildandsave(paths["index_save"]);
+    else
+        index.appendandsave(paths["append_from"], paths["index_save"]);
 }
\ No newline at end of file
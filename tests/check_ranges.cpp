@@ -0,0 +1,398 @@
+#include <cmath>
+#include <thread>
+
+#include "construction.h"
+#include "iRG_search.h"
+#include "iRG_search_disk.h"
+
+// Small end-to-end checks of an index built with leaf_size 1 and the planner off. Each check prints what went
+// wrong and returns the number of failures.
+
+const int n = 200, dim = 8;
+
+using iRangeGraph::AttributeBound;
+using Bound = AttributeBound;
+
+// The point i has the attribute value i / 2 * 5, so every value is held by two points.
+int64_t attribute_value(int pid) { return pid / 2 * 5; }
+
+// The k nearest points to q among [ql, qr] by brute force, as (id, distance) nearest first.
+std::vector<std::pair<int, float>> exact_knn(iRangeGraph::DataLoader &storage, const float *q, int ql, int qr, int k)
+{
+    std::vector<std::pair<float, int>> all;
+    for (int pid = ql; pid <= qr; pid++)
+    {
+        float dist = 0;
+        for (int d = 0; d < dim; d++)
+            dist += (q[d] - storage.data_points[pid][d]) * (q[d] - storage.data_points[pid][d]);
+        all.emplace_back(dist, pid);
+    }
+    std::sort(all.begin(), all.end());
+    std::vector<std::pair<int, float>> res;
+    for (int i = 0; i < std::min<int>(k, all.size()); i++)
+        res.emplace_back(all[i].second, all[i].first);
+    return res;
+}
+
+// The ids of a result, nearest first; distances are left out, as the SIMD kernels may round differently.
+template <typename Result>
+std::vector<int> result_ids(const Result &result)
+{
+    std::vector<int> ids;
+    for (auto &neighbor : result)
+        ids.emplace_back(neighbor.first);
+    return ids;
+}
+
+std::vector<int> result_ids(const std::vector<iRangeGraph::PFI> &result)
+{
+    std::vector<int> ids;
+    for (auto &neighbor : result)
+        ids.emplace_back(neighbor.second);
+    return ids;
+}
+
+// AttributeColumn::ranks over an int64 and a float64 column: inclusive, exclusive and open ends, bounds of the
+// other number type, NaN, and bounds at and beyond the int64 extremes.
+int check_attribute_ranks()
+{
+    const int64_t min = std::numeric_limits<int64_t>::min(), max = std::numeric_limits<int64_t>::max();
+    const int64_t big = (int64_t(1) << 53) + 1;
+    const double inf = std::numeric_limits<double>::infinity(), nan = std::numeric_limits<double>::quiet_NaN();
+    int failures = 0, cases = 0;
+    auto expect = [&](const iRangeGraph::AttributeColumn &column, const char *name, Bound lo, Bound hi, int first, int last)
+    {
+        cases++;
+        std::pair<int, int> ranks = column.ranks(lo, hi);
+        // all empty answers are alike
+        bool same = first > last ? ranks.first > ranks.second : ranks == std::make_pair(first, last);
+        if (!same)
+        {
+            std::cout << name << " case " << cases << ": ranks [" << ranks.first << ", " << ranks.second << "], expected ["
+                      << first << ", " << last << "]" << std::endl;
+            failures++;
+        }
+    };
+    auto expect_throw = [&](const iRangeGraph::AttributeColumn &column, const char *name, Bound lo, Bound hi)
+    {
+        try
+        {
+            column.ranks(lo, hi);
+            std::cout << name << ": a NaN bound was accepted" << std::endl;
+            failures++;
+        }
+        catch (std::exception &)
+        {
+        }
+    };
+
+    iRangeGraph::AttributeColumn ints;
+    ints.assign(iRangeGraph::kAttributeInt64, {min, -5, 0, 0, 3, 7, 10, max});
+    expect(ints, "int", Bound::Inclusive(0), Bound::Inclusive(3), 2, 4);
+    expect(ints, "int", Bound::Exclusive(0), Bound::Exclusive(7), 4, 4);
+    expect(ints, "int", Bound::Exclusive(3), Bound::Exclusive(7), 1, 0);
+    expect(ints, "int", Bound::Unbounded(), Bound::Exclusive(0), 0, 1);
+    expect(ints, "int", Bound::Inclusive(10), Bound::Unbounded(), 6, 7);
+    expect(ints, "int", Bound::Unbounded(), Bound::Unbounded(), 0, 7);
+    expect(ints, "int", Bound::Inclusive(-0.5), Bound::Inclusive(3.5), 2, 4);
+    expect(ints, "int", Bound::Exclusive(0.0), Bound::Exclusive(7.0), 4, 4);
+    expect(ints, "int", Bound::Exclusive(-0.5), Bound::Exclusive(0.5), 2, 3);
+    expect(ints, "int", Bound::Inclusive(min), Bound::Inclusive(min), 0, 0);
+    expect(ints, "int", Bound::Exclusive(min), Bound::Exclusive(max), 1, 6);
+    expect(ints, "int", Bound::Exclusive(max), Bound::Unbounded(), 1, 0);
+    expect(ints, "int", Bound::Unbounded(), Bound::Exclusive(min), 1, 0);
+    expect(ints, "int", Bound::Inclusive(max), Bound::Inclusive(max), 7, 7);
+    expect(ints, "int", Bound::Inclusive(-1e300), Bound::Inclusive(1e300), 0, 7);
+    expect(ints, "int", Bound::Inclusive(0x1p63), Bound::Unbounded(), 1, 0);
+    expect(ints, "int", Bound::Unbounded(), Bound::Exclusive(-0x1p63), 1, 0);
+    expect_throw(ints, "int", Bound::Inclusive(nan), Bound::Unbounded());
+    expect_throw(ints, "int", Bound::Unbounded(), Bound::Exclusive(nan));
+
+    iRangeGraph::AttributeColumn floats;
+    std::vector<int64_t> keys;
+    for (double value : {-inf, -2.5, -0.0, 0.0, 1.0, 1.5, 0x1p53, 0x1p53 + 2, inf})
+        keys.emplace_back(iRangeGraph::OrderedKey(value));
+    floats.assign(iRangeGraph::kAttributeFloat64, keys);
+    expect(floats, "float", Bound::Inclusive(0.0), Bound::Inclusive(1.5), 2, 5);
+    expect(floats, "float", Bound::Exclusive(-0.0), Bound::Exclusive(1.5), 4, 4);
+    expect(floats, "float", Bound::Unbounded(), Bound::Exclusive(-2.5), 0, 0);
+    expect(floats, "float", Bound::Exclusive(-inf), Bound::Exclusive(inf), 1, 7);
+    expect(floats, "float", Bound::Inclusive(1), Bound::Inclusive(1), 4, 4);
+    expect(floats, "float", Bound::Exclusive(1), Bound::Exclusive(2), 5, 5);
+    expect(floats, "float", Bound::Inclusive(-3), Bound::Exclusive(0), 1, 1);
+    // 2^53 + 1 is no double and rounds down to 2^53
+    expect(floats, "float", Bound::Inclusive(big), Bound::Unbounded(), 7, 8);
+    expect(floats, "float", Bound::Exclusive(big), Bound::Unbounded(), 7, 8);
+    expect(floats, "float", Bound::Unbounded(), Bound::Inclusive(big), 0, 6);
+    expect(floats, "float", Bound::Unbounded(), Bound::Exclusive(big), 0, 6);
+    expect(floats, "float", Bound::Exclusive(big - 1), Bound::Inclusive(big - 1), 1, 0);
+    expect(floats, "float", Bound::Inclusive(min), Bound::Inclusive(max), 1, 7);
+    expect(floats, "float", Bound::Exclusive(max), Bound::Unbounded(), 8, 8);
+    expect_throw(floats, "float", Bound::Inclusive(nan), Bound::Unbounded());
+    expect_throw(floats, "float", Bound::Unbounded(), Bound::Inclusive(nan));
+    return failures;
+}
+
+// knn by positions and by attribute values, searchBatch, a search image, a shared image and the disk index all
+// return the exact neighbors when ef is at least the range size.
+int check_search_apis(const std::string &indexpath, iRangeGraph::DataLoader &storage)
+{
+    const int k = 10;
+    std::vector<std::vector<float>> queries;
+    std::vector<std::pair<int, int>> ranges;
+    std::vector<std::vector<int>> expected;
+    for (int ql = 0; ql < n; ql += 9)
+    {
+        for (int qr = ql; qr < n; qr += 17)
+        {
+            queries.emplace_back(storage.data_points[(ql * 3 + qr) % n]);
+            ranges.emplace_back(ql, qr);
+            expected.emplace_back(result_ids(exact_knn(storage, queries.back().data(), ql, qr, k)));
+        }
+    }
+
+    int failures = 0;
+    auto compare = [&](const char *name, size_t i, const std::vector<int> &ids)
+    {
+        if (ids != expected[i])
+        {
+            std::cout << name << ": range [" << ranges[i].first << ", " << ranges[i].second << "] is not exact" << std::endl;
+            failures++;
+        }
+    };
+
+    std::string imagepath = "./check_ranges.img", sharedpath = "./check_ranges.shm", diskpath = "./check_ranges.disk";
+    {
+        iRangeGraph::iRangeGraph_Search<float> index(indexpath);
+        index.plan_ = false;
+        for (size_t i = 0; i < queries.size(); i++)
+        {
+            int ql = ranges[i].first, qr = ranges[i].second;
+            compare("knn", i, result_ids(index.knn(queries[i].data(), ql, qr, k, n)));
+            // the values of [ql, qr] as bounds of either kind
+            auto lo = ql % 2 ? Bound::Exclusive(attribute_value(ql) - 1) : Bound::Inclusive(attribute_value(ql));
+            auto hi = qr % 2 ? Bound::Exclusive(attribute_value(qr) + 1) : Bound::Inclusive(attribute_value(qr));
+            int first = ql % 2 ? ql - 1 : ql, last = qr % 2 ? qr : qr + 1;
+            if (index.attributes_.ranks(lo, hi) != std::make_pair(first, last))
+            {
+                std::cout << "knn: the values of range [" << ql << ", " << qr << "] map to the wrong positions" << std::endl;
+                failures++;
+            }
+            else if (result_ids(index.knn(queries[i].data(), lo, hi, k, n)) != result_ids(exact_knn(storage, queries[i].data(), first, last, k)))
+            {
+                std::cout << "knn: the values of range [" << ql << ", " << qr << "] are not searched exactly" << std::endl;
+                failures++;
+            }
+        }
+        auto batch = index.searchBatch(queries, ranges, k, n, 2);
+        for (size_t i = 0; i < queries.size(); i++)
+            compare("searchBatch", i, result_ids(batch[i]));
+        index.SaveImage(imagepath);
+        index.PublishShared(sharedpath);
+    }
+    for (bool shared : {false, true})
+    {
+        iRangeGraph::iRangeGraph_Search<float> image(shared ? sharedpath : imagepath, 0, false, false, iRangeGraph::kPointMajor, shared);
+        image.plan_ = false;
+        for (size_t i = 0; i < queries.size(); i++)
+            compare(shared ? "shared image" : "image", i, result_ids(image.knn(queries[i].data(), ranges[i].first, ranges[i].second, k, n)));
+    }
+
+    iRangeGraph::iRangeGraph_DiskSearch<float>::BuildDiskIndex(indexpath, diskpath);
+    {
+        iRangeGraph::iRangeGraph_DiskSearch<float> disk(diskpath, nullptr);
+        std::vector<iRangeGraph::TreeNode> filterednodes(disk.tree->max_filtered_nodes());
+        for (size_t i = 0; i < queries.size(); i++)
+        {
+            int ql = ranges[i].first, qr = ranges[i].second;
+            int filtered_num = disk.tree->range_filter(ql, qr, filterednodes.data());
+            auto heap = disk.TopDown_nodeentries_search(filterednodes.data(), filtered_num, queries[i].data(), n, k, ql, qr, disk.M_out);
+            std::vector<int> ids;
+            for (; !heap.empty(); heap.pop())
+                ids.emplace_back(heap.top().second);
+            std::reverse(ids.begin(), ids.end());
+            compare("disk", i, ids);
+        }
+    }
+    std::remove(imagepath.c_str());
+    std::remove(sharedpath.c_str());
+    std::remove(diskpath.c_str());
+    return failures;
+}
+
+// Every two-point range returns both of its points: single-point tree nodes are leaves, and the graph search has
+// to scan them.
+int check_two_point_ranges(iRangeGraph::iRangeGraph_Search<float> &index, iRangeGraph::DataLoader &storage)
+{
+    int failures = 0;
+    for (int ql = 0; ql + 1 < n; ql++)
+    {
+        auto result = index.knn(storage.data_points[(ql * 7) % n].data(), ql, ql + 1, 10, 10);
+        if (result.size() != 2)
+        {
+            std::cout << "range [" << ql << ", " << ql + 1 << "] returned " << result.size() << " points" << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// Deletes points while another thread searches and the background repair runs, then checks that no live list
+// points to a deleted point or outside its tree node, and that searches return only live points, as many as the
+// range holds up to k.
+int check_repair(iRangeGraph::iRangeGraph_Search<float> &index, iRangeGraph::DataLoader &storage)
+{
+    std::vector<int> order(n);
+    for (int pid = 0; pid < n; pid++)
+        order[pid] = pid;
+    std::shuffle(order.begin(), order.end(), std::default_random_engine(1));
+
+    index.startBackgroundRepair();
+    std::atomic<bool> deleting{true};
+    std::thread searching([&]
+                          {
+                              for (int i = 0; deleting; i++)
+                                  index.knn(storage.data_points[i % n].data(), i % 50, n - 1 - i % 50, 10, 10);
+                          });
+    for (int i = 0; i < n / 3; i++)
+        index.markDeleted(order[i]);
+    deleting = false;
+    searching.join();
+    index.stopBackgroundRepair();
+    index.repairDeleted();
+
+    int failures = 0;
+    for (int layer = 0; layer < index.tree->max_depth; layer++)
+    {
+        for (int pid = 0; pid < n; pid++)
+        {
+            if (index.isDeleted(pid))
+                continue;
+            void *list = index.get_linklist(pid, layer);
+            int width = index.layer_width_[layer], base = index.ListBase(pid, layer);
+            iRangeGraph::TreeNode node = index.tree->node_of(pid, layer);
+            for (int j = 1; j <= index.ListEntry(list, width, base, 0); j++)
+            {
+                int neighbor = index.ListEntry(list, width, base, j);
+                if (index.isDeleted(neighbor))
+                {
+                    std::cout << "the list of " << pid << " at layer " << layer << " still holds a deleted point" << std::endl;
+                    failures++;
+                }
+                if (neighbor < node.lbound || neighbor > node.rbound)
+                {
+                    std::cout << "the list of " << pid << " at layer " << layer << " leaves its node" << std::endl;
+                    failures++;
+                }
+            }
+        }
+    }
+    for (int ql = 0; ql < n; ql += 10)
+    {
+        int qr = std::min(n - 1, ql + 4 * (ql % 30) + 5), live = 0;
+        for (int pid = ql; pid <= qr; pid++)
+            live += !index.isDeleted(pid);
+        auto result = index.knn(storage.data_points[ql].data(), ql, qr, 10, 50);
+        for (auto &neighbor : result)
+        {
+            if (index.isDeleted(neighbor.first))
+            {
+                std::cout << "range [" << ql << ", " << qr << "] returned the deleted point " << neighbor.first << std::endl;
+                failures++;
+            }
+        }
+        if (result.size() != (size_t)std::min(live, 10))
+        {
+            std::cout << "range [" << ql << ", " << qr << "] returned " << result.size() << " of its " << live << " live points" << std::endl;
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// Appends the second half of the points to an index over the first half, which grows the root by a level, and
+// checks that the result has the tree of a full rebuild and answers every range the same. With ef at least the
+// range size both searches are exact, so their graphs may differ but their answers may not.
+int check_append(iRangeGraph::DataLoader &storage, const std::string &rebuiltpath)
+{
+    iRangeGraph::DataLoader half = storage;
+    half.data_nb = n / 2;
+    half.data_points.resize(n / 2);
+    std::string halfpath = "./check_ranges_half.bin", appendedpath = "./check_ranges_appended.bin";
+    {
+        iRangeGraph::iRangeGraph_Build<float> builder(&half, 8, 32, 2, 1);
+        builder.buildandsave(halfpath);
+    }
+    {
+        iRangeGraph::iRangeGraph_Build<float> builder(&storage, 8, 32, 2, 1);
+        builder.appendandsave(halfpath, appendedpath);
+    }
+    int failures = 0;
+    {
+        iRangeGraph::iRangeGraph_Search<float> appended(appendedpath), rebuilt(rebuiltpath);
+        appended.plan_ = rebuilt.plan_ = false;
+        if (appended.tree->max_depth != rebuilt.tree->max_depth || appended.tree->root_span != rebuilt.tree->root_span)
+        {
+            std::cout << "the appended index has a different tree than a full rebuild" << std::endl;
+            failures++;
+        }
+        for (int ql = 0; ql < n; ql += 7)
+        {
+            for (int qr = ql; qr < n; qr += 13)
+            {
+                const float *q = storage.data_points[(ql + qr) % n].data();
+                auto a = appended.knn(q, ql, qr, 10, n), b = rebuilt.knn(q, ql, qr, 10, n);
+                if (a != b)
+                {
+                    std::cout << "range [" << ql << ", " << qr << "] differs between the appended and the rebuilt index" << std::endl;
+                    failures++;
+                }
+            }
+        }
+    }
+    std::remove(halfpath.c_str());
+    std::remove(appendedpath.c_str());
+    return failures;
+}
+
+int main()
+{
+    std::default_random_engine e(0);
+    std::uniform_real_distribution<float> u(0, 1);
+    iRangeGraph::DataLoader storage;
+    storage.data_nb = n;
+    storage.Dim = dim;
+    storage.data_points.resize(n, std::vector<float>(dim));
+    for (auto &point : storage.data_points)
+        for (auto &x : point)
+            x = u(e);
+
+    std::string indexpath = "./check_ranges_index.bin";
+    {
+        iRangeGraph::iRangeGraph_Build<float> builder(&storage, 8, 32, 2, 1);
+        std::vector<int64_t> keys;
+        for (int pid = 0; pid < n; pid++)
+            keys.emplace_back(attribute_value(pid));
+        builder.SetAttributes(iRangeGraph::kAttributeInt64, keys);
+        builder.buildandsave(indexpath);
+    }
+
+    int failures = check_attribute_ranks();
+    failures += check_search_apis(indexpath, storage);
+    {
+        iRangeGraph::iRangeGraph_Search<float> index(indexpath);
+        index.plan_ = false;
+        failures += check_two_point_ranges(index, storage);
+    }
+    {
+        iRangeGraph::iRangeGraph_Search<float> index(indexpath);
+        index.plan_ = false;
+        failures += check_repair(index, storage);
+    }
+    failures += check_append(storage, indexpath);
+    std::remove(indexpath.c_str());
+    if (failures)
+        return 1;
+    std::cout << "all checks passed" << std::endl;
+    return 0;
+}
@@ -3,7 +3,12 @@
 std::unordered_map<std::string, std::string> paths;
 
 const int query_K = 10;
-int M;
+// M is read from the index; if given, it has to match
+int M = 0;
+int optional_args = 0;
+int threads = 1;
+bool plan = true;
+iRangeGraph::LinkLayout layout = iRangeGraph::kPointMajor;
 
 void Generate(iRangeGraph::DataLoader &storage)
 {
@@ -51,10 +56,42 @@ int main(int argc, char **argv)
         if (arg == "--result_saveprefix")
             paths["result_saveprefix"] = argv[i + 1];
         if (arg == "--M")
+        {
             M = std::stoi(argv[i + 1]);
+            optional_args++;
+        }
+        if (arg == "--layout")
+        {
+            std::string name = argv[i + 1];
+            if (name == "layer")
+                layout = iRangeGraph::kLayerMajor;
+            else if (name != "point")
+                throw Exception("layout should be point or layer");
+            optional_args++;
+        }
+        if (arg == "--shared")
+        {
+            paths["shared"] = argv[i + 1];
+            optional_args++;
+        }
+        if (arg == "--threads")
+        {
+            threads = std::stoi(argv[i + 1]);
+            optional_args++;
+        }
+        if (arg == "--plan")
+        {
+            plan = std::stoi(argv[i + 1]) != 0;
+            optional_args++;
+        }
+        if (arg == "--save_image")
+        {
+            paths["save_image"] = argv[i + 1];
+            optional_args++;
+        }
     }
 
-    if (argc != 15)
+    if (argc != 13 + 2 * optional_args)
         throw Exception("please check input parameters");
 
     iRangeGraph::DataLoader storage;
@@ -65,8 +102,21 @@ int main(int argc, char **argv)
     storage.LoadQueryRange(paths["range_saveprefix"]);
     storage.LoadGroundtruth(paths["groundtruth_saveprefix"]);
 
-    iRangeGraph::iRangeGraph_Search<float> index(paths["data_vector"], paths["index"], &storage, M);
+    // the first worker publishes the index under the shared name, the others attach to it
+    std::unique_ptr<iRangeGraph::iRangeGraph_Search<float>> index;
+    std::string shared_path = paths["shared"] == "" ? "" : iRangeGraph::SharedImagePath(paths["shared"]);
+    if (shared_path != "" && iRangeGraph::IsSearchImage(shared_path))
+        index.reset(new iRangeGraph::iRangeGraph_Search<float>(shared_path, &storage, M, true, true, layout, true));
+    else
+    {
+        index.reset(new iRangeGraph::iRangeGraph_Search<float>(paths["index"], &storage, M, true, true, layout));
+        if (shared_path != "")
+            index->PublishShared(paths["shared"]);
+    }
+    if (paths["save_image"] != "")
+        index->SaveImage(paths["save_image"]);
+    index->plan_ = plan;
     // searchefs can be adjusted
     std::vector<int> SearchEF = {1700, 1400, 1100, 1000, 900, 800, 700, 600, 500, 400, 300, 250, 200, 180, 160, 140, 120, 100, 90, 80, 70, 60, 55, 50, 45, 40, 35, 30, 25, 20, 15, 10};
-    index.search(SearchEF, paths["result_saveprefix"], M);
+    index->search(SearchEF, paths["result_saveprefix"], index->M_out, threads);
 }
\ No newline at end of file
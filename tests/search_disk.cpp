@@ -0,0 +1,62 @@
+#include "iRG_search_disk.h"
+
+std::unordered_map<std::string, std::string> paths;
+
+const int query_K = 10;
+int beam_width = 4;
+int optional_args = 0;
+
+void Generate(iRangeGraph::DataLoader &storage)
+{
+    storage.LoadData(paths["data_vector"]);
+    iRangeGraph::QueryGenerator generator(storage.data_nb, storage.query_nb);
+    generator.GenerateRange(paths["range_saveprefix"]);
+    storage.LoadQueryRange(paths["range_saveprefix"]);
+    generator.GenerateGroundtruth(paths["groundtruth_saveprefix"], storage);
+}
+
+int main(int argc, char **argv)
+{
+    for (int i = 0; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        if (arg == "--data_path")
+            paths["data_vector"] = argv[i + 1];
+        if (arg == "--query_path")
+            paths["query_vector"] = argv[i + 1];
+        if (arg == "--range_saveprefix")
+            paths["range_saveprefix"] = argv[i + 1];
+        if (arg == "--groundtruth_saveprefix")
+            paths["groundtruth_saveprefix"] = argv[i + 1];
+        if (arg == "--index_file")
+            paths["index"] = argv[i + 1];
+        if (arg == "--disk_file")
+            paths["disk"] = argv[i + 1];
+        if (arg == "--result_saveprefix")
+            paths["result_saveprefix"] = argv[i + 1];
+        if (arg == "--beam_width")
+        {
+            beam_width = std::stoi(argv[i + 1]);
+            optional_args++;
+        }
+    }
+
+    if (argc != 15 + 2 * optional_args)
+        throw Exception("please check input parameters");
+
+    iRangeGraph::DataLoader storage;
+    storage.query_K = query_K;
+    storage.LoadQuery(paths["query_vector"]);
+    // If it is the first run, Generate shall be called; otherwise, Generate can be skipped
+    Generate(storage);
+    storage.LoadQueryRange(paths["range_saveprefix"]);
+    storage.LoadGroundtruth(paths["groundtruth_saveprefix"]);
+
+    // the disk index is written from the index file on the first run
+    if (!std::filesystem::exists(paths["disk"]))
+        iRangeGraph::iRangeGraph_DiskSearch<float>::BuildDiskIndex(paths["index"], paths["disk"]);
+    iRangeGraph::iRangeGraph_DiskSearch<float> index(paths["disk"], &storage, beam_width);
+    // searchefs can be adjusted
+    std::vector<int> SearchEF = {1700, 1400, 1100, 1000, 900, 800, 700, 600, 500, 400, 300, 250, 200, 180, 160, 140, 120, 100, 90, 80, 70, 60, 55, 50, 45, 40, 35, 30, 25, 20, 15, 10};
+    index.search(SearchEF, paths["result_saveprefix"], index.M_out);
+}
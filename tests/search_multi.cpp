@@ -3,7 +3,9 @@
 std::unordered_map<std::string, std::string> paths;
 
 const int query_K = 10;
-int M;
+// M is read from the index; if given, it has to match
+int M = 0;
+int optional_args = 0;
 
 void Generate(iRangeGraph_multi::DataLoader &storage)
 {
@@ -34,10 +36,13 @@ int main(int argc, char **argv)
         if (arg == "--attribute2")
             paths["attribute2"] = argv[i + 1];
         if (arg == "--M")
+        {
             M = std::stoi(argv[i + 1]);
+            optional_args++;
+        }
     }
 
-    if (argc != 19)
+    if (argc != 17 + 2 * optional_args)
         throw Exception("please check input parameters");
 
     iRangeGraph_multi::DataLoader storage;
@@ -60,5 +65,5 @@ int main(int argc, char **argv)
     index.setprob();
     std::vector<int>
         SearchEF = {1400, 700, 400, 300, 250, 200, 180, 160, 140, 120, 100, 90, 80, 70, 60, 55, 50, 45, 40, 35, 30, 25, 20, 15, 10};
-    index.search(SearchEF, paths["result_saveprefix"], M);
+    index.search(SearchEF, paths["result_saveprefix"], index.M_out);
 }
\ No newline at end of file